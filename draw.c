@@ -1,4 +1,11 @@
 #include "draw.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define DRAW_SSE2 1
+#endif
 
 #define abs(x) ( ((x) < 0) ? -(x) : (x))
 
@@ -21,11 +28,7 @@ static int round_i(float f)
 
 static float frac(float f)
 {
-	if(f < 0) {
-		return 1.0f - (f - floor_i(f));
-	}
-	
-	return f - floor_i(f);
+	return f - floorf(f);
 }
 
 static float remainder_frac(float f)
@@ -65,31 +68,94 @@ Rect2D tri_bounds(Triangle2D tri) {
 	return (Rect2D) { min, max };
 }
 
-Vec3D barycentric_coords(Triangle2D tri, Point2D point)
+// Per-triangle setup shared by the interpolating fillers. Edge i is the edge
+// opposite vertex i, written as ex * x + ey * y + e0 and oriented so that it
+// is non-negative inside the triangle. Samples sit on integer coordinates and
+// the y range is limited to rows that land inside the image.
+typedef struct {
+	float ex[3];
+	float ey[3];
+	float e0[3];
+	float area;
+	int y_min;
+	int y_max;
+} TriSetup;
+
+static bool tri_setup(const Image* image, Triangle2D tri, TriSetup* setup)
 {
-	Vec3D v = vec3(tri.p3.x - tri.p1.x, tri.p2.x - tri.p1.x, tri.p1.x - point.x);
-	Vec3D u = vec3(tri.p3.y - tri.p1.y, tri.p2.y - tri.p1.y, tri.p1.y - point.y);
+	Point2D p[3] = { tri.p1, tri.p2, tri.p3 };
+	float area = ((p[1].x - p[0].x) * (p[2].y - p[0].y)) - ((p[1].y - p[0].y) * (p[2].x - p[0].x));
 	
-	Vec3D r = vec3_cross(v, u);
+	if(area == 0) {
+		return false;
+	}
 	
-	if(abs(r.y) < 1) return vec3(-1, 1, 1);
+	float sign = (area > 0) ? 1.0f : -1.0f;
 	
-	return vec3(1 - (r.x + r.y)/r.z, r.y/r.z, r.x/r.z);
+	int i;
+	for(i = 0; i < 3; i++) {
+		Point2D a = p[(i + 1) % 3];
+		Point2D b = p[(i + 2) % 3];
+		setup->ex[i] = sign * (a.y - b.y);
+		setup->ey[i] = sign * (b.x - a.x);
+		setup->e0[i] = sign * ((a.x * b.y) - (a.y * b.x));
+	}
+	
+	Rect2D bounds = tri_bounds(tri);
+	setup->area = area * sign;
+	setup->y_min = max((int)ceilf(bounds.bot_left.y), 1);
+	setup->y_max = min((int)floorf(bounds.top_right.y), image->header.height);
+	
+	return setup->y_min <= setup->y_max;
 }
 
-Vec2D vec2(float x, float y)
+// Solves the three edge inequalities for row y, giving the inclusive range of
+// covered x samples clipped to the image. Returns false for an empty row.
+static bool tri_span(const Image* image, const TriSetup* setup, int y, int* x0, int* x1)
 {
-	return (Vec2D) { x, y };
+	float lo = 0;
+	float hi = image->header.width - 1;
+	
+	int i;
+	for(i = 0; i < 3; i++) {
+		float c = (setup->ey[i] * y) + setup->e0[i];
+		
+		if(setup->ex[i] > 0) {
+			lo = fmaxf(lo, -c / setup->ex[i]);
+		} else if(setup->ex[i] < 0) {
+			hi = fminf(hi, -c / setup->ex[i]);
+		} else if(c < 0) {
+			return false;
+		}
+	}
+	
+	*x0 = (int)ceilf(lo);
+	*x1 = (int)floorf(hi);
+	
+	return *x0 <= *x1;
 }
 
-Vec3D vec3(float x, float y, float z)
+// Plane equation a(x, y) = dx * x + dy * y + a0 through the three vertex
+// values, built from the barycentric weight of each vertex.
+static void tri_plane(const TriSetup* setup, float a1, float a2, float a3, float* dx, float* dy, float* a0)
 {
-	return (Vec3D) { x, y, z };
+	float inv_area = 1.0f / setup->area;
+	
+	*dx = ((setup->ex[0] * a1) + (setup->ex[1] * a2) + (setup->ex[2] * a3)) * inv_area;
+	*dy = ((setup->ey[0] * a1) + (setup->ey[1] * a2) + (setup->ey[2] * a3)) * inv_area;
+	*a0 = ((setup->e0[0] * a1) + (setup->e0[1] * a2) + (setup->e0[2] * a3)) * inv_area;
 }
 
-Point2D point2(float x, float y)
+Vec3D barycentric_coords(Triangle2D tri, Point2D point)
 {
-	return (Point2D) { x, y };
+	Vec3D v = vec3(tri.p3.x - tri.p1.x, tri.p2.x - tri.p1.x, tri.p1.x - point.x);
+	Vec3D u = vec3(tri.p3.y - tri.p1.y, tri.p2.y - tri.p1.y, tri.p1.y - point.y);
+	
+	Vec3D r = vec3_cross(v, u);
+	
+	if(abs(r.y) < 1) return vec3(-1, 1, 1);
+	
+	return vec3(1 - (r.x + r.y)/r.z, r.y/r.z, r.x/r.z);
 }
 
 ColorRGB rgb(int r, int g, int b)
@@ -101,93 +167,241 @@ ColorRGB rgb(int r, int g, int b)
 	};
 }
 
-Vec2D vec2_add(Vec2D l, Vec2D r)
+ColorRGB blend(ColorRGB bg, ColorRGB fg, float alpha)
 {
-	return (Vec2D) { l.x + r.x, l.y + r.y };
+	ColorRGB blended;
+	blended.r = (uint8_t)((alpha * fg.r) + ((1.0f - alpha) * bg.r));
+	blended.g = (uint8_t)((alpha * fg.g) + ((1.0f - alpha) * bg.g));
+	blended.b = (uint8_t)((alpha * fg.b) + ((1.0f - alpha) * bg.b));
+	
+	return blended;
 }
 
-Vec2D vec2_sub(Vec2D l, Vec2D r)
-{
-	return (Vec2D) { l.x - r.x, l.y - r.y };
-}
+// Linear light is held as 12-bit integers: enough that every sRGB byte
+// survives a round trip, small enough that the encode table stays in L1.
+#define LINEAR_BITS 12
+#define LINEAR_MAX ((1 << LINEAR_BITS) - 1)
+#define ALPHA_ONE 256
 
-Vec2D vec2_scale(Vec2D v, float scale)
-{
-	return (Vec2D) { v.x * scale, v.y * scale };
-}
+static uint16_t srgb_to_linear[256];
+static uint8_t linear_to_srgb[LINEAR_MAX + 1];
+static pthread_once_t gamma_once = PTHREAD_ONCE_INIT;
 
-float vec2_dot(Vec2D l, Vec2D r)
+static void gamma_init(void)
 {
-	return (l.x * r.x) + (l.y * r.y);
+	int i;
+	for(i = 0; i < 256; i++) {
+		double c = i / 255.0;
+		double l = (c <= 0.04045) ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+		srgb_to_linear[i] = (uint16_t)((l * LINEAR_MAX) + 0.5);
+	}
+	
+	for(i = 0; i <= LINEAR_MAX; i++) {
+		double l = (double)i / LINEAR_MAX;
+		double c = (l <= 0.0031308) ? l * 12.92 : (1.055 * pow(l, 1 / 2.4)) - 0.055;
+		linear_to_srgb[i] = (uint8_t)((c * 255) + 0.5);
+	}
 }
 
-float vec2_mag(Vec2D v)
+static inline int alpha_fixed(float alpha)
 {
-	return sqrt(vec2_dot(v, v));
+	return clamp((int)((alpha * ALPHA_ONE) + 0.5f), 0, ALPHA_ONE);
 }
 
-float vec2_mag_sqr(Vec2D v)
+static inline uint8_t mix_linear(uint8_t bg, uint8_t fg, int a)
 {
-	return vec2_dot(v, v);
+	int l = (srgb_to_linear[fg] * a) + (srgb_to_linear[bg] * (ALPHA_ONE - a));
+	
+	return linear_to_srgb[(l + (ALPHA_ONE / 2)) >> 8];
 }
 
-Vec2D vec2_negate(Vec2D v)
+ColorRGB blend_linear(ColorRGB bg, ColorRGB fg, float alpha)
 {
-	return (Vec2D) { -v.x, -v.y };
+	pthread_once(&gamma_once, gamma_init);
+	
+	int a = alpha_fixed(alpha);
+	
+	return (ColorRGB) {
+		mix_linear(bg.r, fg.r, a),
+		mix_linear(bg.g, fg.g, a),
+		mix_linear(bg.b, fg.b, a)
+	};
 }
 
-Vec3D vec3_add(Vec3D l, Vec3D r)
+ColorRGB blend_space(ColorRGB bg, ColorRGB fg, float alpha, PPM_BlendSpace space)
 {
-	return (Vec3D) { l.x + r.x, l.y + r.y, l.z + r.z };
+	if(space == PPM_BLEND_LINEAR) {
+		return blend_linear(bg, fg, alpha);
+	}
+	
+	return blend(bg, fg, alpha);
 }
 
-Vec3D vec3_sub(Vec3D l, Vec3D r)
+// Span kernels for the _alpha drawing paths. blend_span() is written once
+// and specialised by BLEND_SPAN into one function per blend mode, alpha
+// source and blend space, so the mode, space and alpha source are constants
+// inside every loop. alpha is 0..ALPHA_ONE; a coverage kernel additionally
+// scales it per pixel by coverage[i] (0..255).
+typedef void (*BlendSpanFn)(PPM_Pixel* out, int n, ColorRGB color, int alpha, const uint8_t* coverage);
+
+// Mode result for one channel, with channel values in 0..one.
+static inline int blend_op(int d, int c, int one, PPM_BlendMode mode)
 {
-	return (Vec3D) { l.x - r.x, l.y - r.y, l.z - r.z };
+	switch(mode) {
+		case PPM_BLEND_ADD:
+			return (d + c > one) ? one : d + c;
+		case PPM_BLEND_MULTIPLY:
+			return ((d * c) + (one / 2)) / one;
+		case PPM_BLEND_SCREEN:
+			return one - ((((one - d) * (one - c)) + (one / 2)) / one);
+		case PPM_BLEND_MIN:
+			return (d < c) ? d : c;
+		case PPM_BLEND_MAX:
+			return (d > c) ? d : c;
+		default:
+			return c;
+	}
 }
 
-Vec3D vec3_scale(Vec3D v, float scale)
+static inline uint8_t blend_channel(uint8_t dest, int c, int a, PPM_BlendMode mode, bool linear)
 {
-	return (Vec3D) { v.x * scale, v.y * scale, v.z * scale };
+	int one = linear ? LINEAR_MAX : 255;
+	int d = linear ? srgb_to_linear[dest] : dest;
+	int v = ((blend_op(d, c, one, mode) * a) + (d * (ALPHA_ONE - a)) + (ALPHA_ONE / 2)) >> 8;
+	
+	return linear ? linear_to_srgb[v] : (uint8_t)v;
 }
 
-float vec3_dot(Vec3D l, Vec3D r)
+static inline void blend_span(PPM_Pixel* out, int n, ColorRGB color, int alpha, const uint8_t* coverage, PPM_BlendMode mode, bool per_pixel, bool linear)
 {
-	return (l.x * r.x) + (l.y * r.y) + (l.z * r.z);
+	int r = linear ? srgb_to_linear[color.r] : color.r;
+	int g = linear ? srgb_to_linear[color.g] : color.g;
+	int b = linear ? srgb_to_linear[color.b] : color.b;
+	
+	int i;
+	for(i = 0; i < n; i++) {
+		int a = alpha;
+		
+		if(per_pixel) {
+			a = (alpha * (coverage[i] + (coverage[i] >> 7))) >> 8;
+		}
+		
+		out[i].r = blend_channel(out[i].r, r, a, mode, linear);
+		out[i].g = blend_channel(out[i].g, g, a, mode, linear);
+		out[i].b = blend_channel(out[i].b, b, a, mode, linear);
+	}
 }
 
-Vec3D vec3_cross(Vec3D l, Vec3D r)
+#define BLEND_SPAN(name, mode, per_pixel, linear) \
+	static void name(PPM_Pixel* out, int n, ColorRGB color, int alpha, const uint8_t* coverage) \
+	{ \
+		blend_span(out, n, color, alpha, coverage, mode, per_pixel, linear); \
+	}
+
+#define BLEND_SPANS(name, mode) \
+	BLEND_SPAN(name, mode, false, false) \
+	BLEND_SPAN(name##_coverage, mode, true, false) \
+	BLEND_SPAN(name##_linear, mode, false, true) \
+	BLEND_SPAN(name##_coverage_linear, mode, true, true)
+
+BLEND_SPANS(blend_normal, PPM_BLEND_NORMAL)
+BLEND_SPANS(blend_add, PPM_BLEND_ADD)
+BLEND_SPANS(blend_multiply, PPM_BLEND_MULTIPLY)
+BLEND_SPANS(blend_screen, PPM_BLEND_SCREEN)
+BLEND_SPANS(blend_min, PPM_BLEND_MIN)
+BLEND_SPANS(blend_max, PPM_BLEND_MAX)
+
+#define BLEND_SPAN_ENTRY(name) \
+	{ { name, name##_coverage }, { name##_linear, name##_coverage_linear } }
+
+// Indexed [mode][linear][per_pixel].
+static const BlendSpanFn blend_spans[PPM_BLEND_MAX + 1][2][2] = {
+	BLEND_SPAN_ENTRY(blend_normal),
+	BLEND_SPAN_ENTRY(blend_add),
+	BLEND_SPAN_ENTRY(blend_multiply),
+	BLEND_SPAN_ENTRY(blend_screen),
+	BLEND_SPAN_ENTRY(blend_min),
+	BLEND_SPAN_ENTRY(blend_max)
+};
+
+static void span_store(PPM_Pixel* out, int n, ColorRGB color, int alpha, const uint8_t* coverage)
 {
-	float vx = (l.y * r.z) - (l.z * r.y);
-	float vy = -((l.x * r.z) - (l.z * r.x));
-	float vz = (l.x * r.y) - (l.y * r.x);
+	(void)alpha;
+	(void)coverage;
 	
-	return (Vec3D) { vx, vy, vz };
+	int i;
+	for(i = 0; i < n; i++) {
+		out[i] = color;
+	}
 }
 
-float vec3_mag(Vec3D v)
+static void span_skip(PPM_Pixel* out, int n, ColorRGB color, int alpha, const uint8_t* coverage)
 {
-	return sqrt(vec3_dot(v, v));
+	(void)out;
+	(void)n;
+	(void)color;
+	(void)alpha;
+	(void)coverage;
 }
 
-float vec3_mag_sqr(Vec3D v)
+// Picks the kernel once per span. Fully opaque normal blending is a plain
+// store and fully transparent drawing does nothing in every mode.
+static BlendSpanFn blend_span_fn(const Image* image, int alpha, bool per_pixel)
 {
-	return vec3_dot(v, v);
+	if(alpha == 0) {
+		return span_skip;
+	}
+	
+	if(image->blend_mode == PPM_BLEND_NORMAL && alpha == ALPHA_ONE && !per_pixel) {
+		return span_store;
+	}
+	
+	bool linear = image->blend_space == PPM_BLEND_LINEAR;
+	
+	if(linear) {
+		pthread_once(&gamma_once, gamma_init);
+	}
+	
+	return blend_spans[image->blend_mode][linear][per_pixel];
 }
 
-Vec3D vec3_negate(Vec3D v)
+// Blends color into buffer row y from x0 to x1 inclusive (already clipped),
+// walking the row run by run. coverage, if not NULL, holds one weight per
+// pixel of the span.
+static void blend_row(Image* image, int y, int x0, int x1, ColorRGB color, float alpha, const uint8_t* coverage)
 {
-	return (Vec3D) { -v.x, -v.y, -v.z };
+	int a = alpha_fixed(alpha);
+	BlendSpanFn span = blend_span_fn(image, a, coverage != NULL);
+	int x = x0;
+	
+	while(x <= x1) {
+		int run;
+		PPM_Pixel* out = ppm_run(image, x, y, &run);
+		run = min(run, x1 - x + 1);
+		
+		span(out, run, color, a, coverage ? &coverage[x - x0] : NULL);
+		
+		x += run;
+	}
 }
 
-ColorRGB blend(ColorRGB bg, ColorRGB fg, float alpha)
+// Writes color over buffer row y from x0 to x1 inclusive (already clipped).
+static void store_row(Image* image, int y, int x0, int x1, ColorRGB color)
 {
-	ColorRGB blended;
-	blended.r = (uint8_t)((alpha * fg.r) + ((1.0f - alpha) * bg.r));
-	blended.g = (uint8_t)((alpha * fg.g) + ((1.0f - alpha) * bg.g));
-	blended.b = (uint8_t)((alpha * fg.b) + ((1.0f - alpha) * bg.b));
+	int x = x0;
 	
-	return blended;
+	while(x <= x1) {
+		int run;
+		PPM_Pixel* out = ppm_run(image, x, y, &run);
+		run = min(run, x1 - x + 1);
+		
+		int i;
+		for(i = 0; i < run; i++) {
+			out[i] = color;
+		}
+		
+		x += run;
+	}
 }
 
 void draw_point(Image* image, Point2D point, ColorRGB color)
@@ -197,8 +411,14 @@ void draw_point(Image* image, Point2D point, ColorRGB color)
 
 void draw_point_alpha(Image* image, Point2D point, ColorRGB color, float alpha)
 {
-	ColorRGB blended = blend(ppm_get_pixel(image, round(point.x), round(point.y)), color, alpha);
-	ppm_set_pixel(image, round(point.x), round(image->header.height - point.y), blended);
+	int x = round(point.x);
+	int y = round(image->header.height - point.y);
+	
+	if(x < 0 || y < 0 || x >= image->header.width || y >= image->header.height) {
+		return;
+	}
+	
+	blend_row(image, y, x, x, color, alpha, NULL);
 }
 
 void draw_line(Image* image, Point2D p1, Point2D p2, ColorRGB color)
@@ -318,13 +538,36 @@ void draw_circle(Image* image, Point2D origin, float radius, ColorRGB color, boo
 void draw_circle_alpha(Image* image, Point2D origin, float radius, ColorRGB color, float alpha, bool filled)
 {
 	if(filled) {
-		int x = round(origin.x - radius);
-		int y = round((image->header.height - origin.y) - radius);
+		// The same samples as draw_circle, origin + (x, y) with x^2 + y^2 <
+		// radius^2, blended a row span at a time.
+		int r = round(radius);
+		int y;
 		
-		for(; y < origin.y + radius; y++) {
-			for(; x < origin.x + radius; x++) {
-				if((x * x) + (y * y) < (radius * radius)) {
-					draw_point_alpha(image, point2(x, image->header.height - y), color, alpha);
+		for(y = -r; y < r; y++) {
+			int x = -r;
+			
+			while(x < r && (x * x) + (y * y) >= (radius * radius)) {
+				x++;
+			}
+			
+			if(x == r) {
+				continue;
+			}
+			
+			int row = round(image->header.height - (origin.y + y));
+			int x0 = round(origin.x + x);
+			int x1 = round(origin.x - x);
+			
+			if(-x >= r) {
+				x1--;
+			}
+			
+			if(row >= 0 && row < image->header.height) {
+				x0 = max(x0, 0);
+				x1 = min(x1, image->header.width - 1);
+				
+				if(x0 <= x1) {
+					blend_row(image, row, x0, x1, color, alpha, NULL);
 				}
 			}
 		}
@@ -355,6 +598,32 @@ void draw_circle_alpha(Image* image, Point2D origin, float radius, ColorRGB colo
 	}
 }
 
+// Fills the samples inside tri a row span at a time, so each pixel is written
+// once. Opaque fills store the color whatever the image's blend mode.
+static void fill_triangle(Image* image, Triangle2D tri, ColorRGB color, float alpha, bool opaque)
+{
+	TriSetup setup;
+	
+	if(!tri_setup(image, tri, &setup)) {
+		return;
+	}
+	
+	int y;
+	for(y = setup.y_min; y <= setup.y_max; y++) {
+		int x0, x1;
+		
+		if(!tri_span(image, &setup, y, &x0, &x1)) {
+			continue;
+		}
+		
+		if(opaque) {
+			store_row(image, image->header.height - y, x0, x1, color);
+		} else {
+			blend_row(image, image->header.height - y, x0, x1, color, alpha, NULL);
+		}
+	}
+}
+
 void draw_triangle(Image* image, Triangle2D tri, ColorRGB color, bool filled)
 {
 	if(!filled) {
@@ -362,21 +631,7 @@ void draw_triangle(Image* image, Triangle2D tri, ColorRGB color, bool filled)
 		draw_line(image, tri.p2, tri.p3, color);
 		draw_line(image, tri.p3, tri.p1, color);
 	} else {
-		Rect2D bounds = tri_bounds(tri);
-		int x;
-		int y;
-		
-		for(y = round(bounds.top_right.y) - 1; y <= round(bounds.top_right.y); y++) {
-			for(x = round(bounds.bot_left.x) - 1; x <= round(bounds.top_right.x); x++) {
-				Vec3D bary = barycentric_coords(tri, point2(x, y));
-				
-				if(bary.x < 0 || bary.y < 0 || bary.z < 0) {
-					continue;
-				} else {
-					draw_point(image, point2(x, y), color);
-				}
-			}
-		}
+		fill_triangle(image, tri, color, 1.0f, true);
 	}
 }
 
@@ -387,22 +642,642 @@ void draw_triangle_alpha(Image* image, Triangle2D tri, ColorRGB color, float alp
 		draw_line_alpha(image, tri.p2, tri.p3, color, alpha);
 		draw_line_alpha(image, tri.p3, tri.p1, color, alpha);
 	} else {
-		Rect2D bounds = tri_bounds(tri);
-		int x;
-		int y;
+		fill_triangle(image, tri, color, alpha, false);
+	}
+}
+
+#define FIXED_SHIFT 16
+#define FIXED_MAX ((256 << FIXED_SHIFT) - 1)
+
+// 16.16 value of the plane at the two ends of a span, clamped so that rounding
+// at the triangle's edges can never step outside 0..255 in between.
+static void fixed_span(float dx, float at_start, int n, int32_t* start, int32_t* step)
+{
+	float at_end = at_start + (dx * (n - 1));
+	int32_t first = clamp((int)((at_start + 0.5f) * (1 << FIXED_SHIFT)), 0, FIXED_MAX);
+	int32_t last = clamp((int)((at_end + 0.5f) * (1 << FIXED_SHIFT)), 0, FIXED_MAX);
+	
+	*start = first;
+	*step = (n > 1) ? (last - first) / (n - 1) : 0;
+}
+
+void draw_triangle_gouraud(Image* image, Triangle2D tri, ColorRGB c1, ColorRGB c2, ColorRGB c3)
+{
+	TriSetup setup;
+	
+	if(!tri_setup(image, tri, &setup)) {
+		return;
+	}
+	
+	float rdx, rdy, r0;
+	float gdx, gdy, g0;
+	float bdx, bdy, b0;
+	tri_plane(&setup, c1.r, c2.r, c3.r, &rdx, &rdy, &r0);
+	tri_plane(&setup, c1.g, c2.g, c3.g, &gdx, &gdy, &g0);
+	tri_plane(&setup, c1.b, c2.b, c3.b, &bdx, &bdy, &b0);
+	
+	int y;
+	for(y = setup.y_min; y <= setup.y_max; y++) {
+		int x0, x1;
+		
+		if(!tri_span(image, &setup, y, &x0, &x1)) {
+			continue;
+		}
+		
+		int n = x1 - x0 + 1;
+		int32_t r, g, b, dr, dg, db;
+		fixed_span(rdx, (rdx * x0) + (rdy * y) + r0, n, &r, &dr);
+		fixed_span(gdx, (gdx * x0) + (gdy * y) + g0, n, &g, &dg);
+		fixed_span(bdx, (bdx * x0) + (bdy * y) + b0, n, &b, &db);
+		
+		int row = image->header.height - y;
+		int x = x0;
 		
-		for(y = round(bounds.bot_left.y) - 1; y <= round(bounds.top_right.y); y++) {
-			for(x = round(bounds.bot_left.x) - 1; x <= round(bounds.top_right.x); x++) {
-				Vec3D bary = barycentric_coords(tri, point2(x, y));
+		while(x <= x1) {
+			int run;
+			PPM_Pixel* out = ppm_run(image, x, row, &run);
+			run = min(run, x1 - x + 1);
+			
+			int i = 0;
+
+#ifdef DRAW_SSE2
+			// Four pixels per step, one per lane, packed as r | g << 8 |
+			// b << 16 and stored 4 bytes at a time. Each store spills a byte
+			// into the following pixel, which the next store or the scalar
+			// tail then overwrites, so stop while one pixel remains.
+			__m128i vr = _mm_set_epi32(r + (3 * dr), r + (2 * dr), r + dr, r);
+			__m128i vg = _mm_set_epi32(g + (3 * dg), g + (2 * dg), g + dg, g);
+			__m128i vb = _mm_set_epi32(b + (3 * db), b + (2 * db), b + db, b);
+			__m128i step_r = _mm_set1_epi32(4 * dr);
+			__m128i step_g = _mm_set1_epi32(4 * dg);
+			__m128i step_b = _mm_set1_epi32(4 * db);
+			
+			for(; i + 4 < run; i += 4) {
+				__m128i packed = _mm_or_si128(_mm_srli_epi32(vr, FIXED_SHIFT),
+					_mm_or_si128(_mm_slli_epi32(_mm_srli_epi32(vg, FIXED_SHIFT), 8),
+						_mm_slli_epi32(_mm_srli_epi32(vb, FIXED_SHIFT), 16)));
+				uint32_t lanes[4];
+				_mm_storeu_si128((__m128i*)lanes, packed);
 				
-				if(bary.x < 0 || bary.y < 0 || bary.z < 0) {
-					continue;
-				} else {
-					draw_point_alpha(image, point2(x, y), color, alpha);
+				memcpy(&out[i], &lanes[0], sizeof(uint32_t));
+				memcpy(&out[i + 1], &lanes[1], sizeof(uint32_t));
+				memcpy(&out[i + 2], &lanes[2], sizeof(uint32_t));
+				memcpy(&out[i + 3], &lanes[3], sizeof(uint32_t));
+				
+				vr = _mm_add_epi32(vr, step_r);
+				vg = _mm_add_epi32(vg, step_g);
+				vb = _mm_add_epi32(vb, step_b);
+			}
+			
+			r += dr * i;
+			g += dg * i;
+			b += db * i;
+#endif
+			
+			for(; i < run; i++) {
+				out[i].r = (uint8_t)(r >> FIXED_SHIFT);
+				out[i].g = (uint8_t)(g >> FIXED_SHIFT);
+				out[i].b = (uint8_t)(b >> FIXED_SHIFT);
+				r += dr;
+				g += dg;
+				b += db;
+			}
+			
+			x += run;
+		}
+	}
+}
+
+static int64_t wrap_fixed(int64_t v, int64_t size)
+{
+	v %= size;
+	
+	return (v < 0) ? v + size : v;
+}
+
+static inline size_t texel_index(const Image* tex, int x, int y, bool tiled)
+{
+	return tiled ? ppm_tiled_index(tex, x, y) : ((size_t)y * tex->header.width) + x;
+}
+
+// Fills n pixels from 16.16 texel coordinates (s, t) stepping by (ds, dt).
+// Only ever called with constant filter, wrap and layout arguments (see
+// TEXTURE_SPAN below) so each combination compiles to its own loop. In wrap
+// mode the coordinates are kept inside the texture incrementally, so no texel
+// fetch needs a bounds check or a division.
+static inline void texture_span(PPM_Pixel* out, int n, const Image* tex, int64_t s, int64_t t, int64_t ds, int64_t dt, bool bilinear, bool wrap, bool tiled)
+{
+	const PPM_Pixel* texels = tex->buffer;
+	int w = tex->header.width;
+	int h = tex->header.height;
+	int64_t ws = (int64_t)w << FIXED_SHIFT;
+	int64_t hs = (int64_t)h << FIXED_SHIFT;
+	
+	if(wrap) {
+		s = wrap_fixed(s, ws);
+		t = wrap_fixed(t, hs);
+		ds %= ws;
+		dt %= hs;
+	}
+	
+	int i;
+	for(i = 0; i < n; i++) {
+		int x0 = (int)(s >> FIXED_SHIFT);
+		int y0 = (int)(t >> FIXED_SHIFT);
+		
+		if(!bilinear) {
+			if(!wrap) {
+				x0 = clamp(x0, 0, w - 1);
+				y0 = clamp(y0, 0, h - 1);
+			}
+			
+			out[i] = texels[texel_index(tex, x0, y0, tiled)];
+		} else {
+			int x1 = x0 + 1;
+			int y1 = y0 + 1;
+			int fx = (int)(s >> (FIXED_SHIFT - 8)) & 0xFF;
+			int fy = (int)(t >> (FIXED_SHIFT - 8)) & 0xFF;
+			
+			if(wrap) {
+				x1 = (x1 == w) ? 0 : x1;
+				y1 = (y1 == h) ? 0 : y1;
+			} else {
+				x0 = clamp(x0, 0, w - 1);
+				x1 = clamp(x1, 0, w - 1);
+				y0 = clamp(y0, 0, h - 1);
+				y1 = clamp(y1, 0, h - 1);
+			}
+			
+			PPM_Pixel t00 = texels[texel_index(tex, x0, y0, tiled)];
+			PPM_Pixel t10 = texels[texel_index(tex, x1, y0, tiled)];
+			PPM_Pixel t01 = texels[texel_index(tex, x0, y1, tiled)];
+			PPM_Pixel t11 = texels[texel_index(tex, x1, y1, tiled)];
+			int w00 = (256 - fx) * (256 - fy);
+			int w10 = fx * (256 - fy);
+			int w01 = (256 - fx) * fy;
+			int w11 = fx * fy;
+			
+			out[i].r = (uint8_t)(((t00.r * w00) + (t10.r * w10) + (t01.r * w01) + (t11.r * w11)) >> 16);
+			out[i].g = (uint8_t)(((t00.g * w00) + (t10.g * w10) + (t01.g * w01) + (t11.g * w11)) >> 16);
+			out[i].b = (uint8_t)(((t00.b * w00) + (t10.b * w10) + (t01.b * w01) + (t11.b * w11)) >> 16);
+		}
+		
+		s += ds;
+		t += dt;
+		
+		if(wrap) {
+			s -= (s >= ws) ? ws : 0;
+			s += (s < 0) ? ws : 0;
+			t -= (t >= hs) ? hs : 0;
+			t += (t < 0) ? hs : 0;
+		}
+	}
+}
+
+typedef void (*TextureSpanFn)(PPM_Pixel* out, int n, const Image* tex, int64_t s, int64_t t, int64_t ds, int64_t dt);
+
+#define TEXTURE_SPAN(name, bilinear, wrap, tiled) \
+	static void name(PPM_Pixel* out, int n, const Image* tex, int64_t s, int64_t t, int64_t ds, int64_t dt) \
+	{ \
+		texture_span(out, n, tex, s, t, ds, dt, bilinear, wrap, tiled); \
+	}
+
+TEXTURE_SPAN(span_nearest_clamp, false, false, false)
+TEXTURE_SPAN(span_bilinear_clamp, true, false, false)
+TEXTURE_SPAN(span_nearest_wrap, false, true, false)
+TEXTURE_SPAN(span_bilinear_wrap, true, true, false)
+TEXTURE_SPAN(span_nearest_clamp_tiled, false, false, true)
+TEXTURE_SPAN(span_bilinear_clamp_tiled, true, false, true)
+TEXTURE_SPAN(span_nearest_wrap_tiled, false, true, true)
+TEXTURE_SPAN(span_bilinear_wrap_tiled, true, true, true)
+
+// Indexed by [tiled][wrap][bilinear].
+static const TextureSpanFn texture_spans[2][2][2] = {
+	{ { span_nearest_clamp, span_bilinear_clamp }, { span_nearest_wrap, span_bilinear_wrap } },
+	{ { span_nearest_clamp_tiled, span_bilinear_clamp_tiled }, { span_nearest_wrap_tiled, span_bilinear_wrap_tiled } }
+};
+
+void draw_triangle_textured(Image* dest, Triangle2D tri, const Vec2D* uvs, const Image* tex, TextureFilter filter)
+{
+	TriSetup setup;
+	
+	if(!tri_setup(dest, tri, &setup)) {
+		return;
+	}
+	
+	// Texture coordinates are set up directly in texel units; v runs up the
+	// texture like y does in the destination, so it is flipped into rows.
+	float w = tex->header.width;
+	float h = tex->header.height;
+	float bias = (filter & TEXTURE_BILINEAR) ? 0.5f : 0.0f;
+	
+	float sdx, sdy, s0;
+	float tdx, tdy, t0;
+	tri_plane(&setup, (uvs[0].x * w) - bias, (uvs[1].x * w) - bias, (uvs[2].x * w) - bias, &sdx, &sdy, &s0);
+	tri_plane(&setup, ((1 - uvs[0].y) * h) - bias, ((1 - uvs[1].y) * h) - bias, ((1 - uvs[2].y) * h) - bias, &tdx, &tdy, &t0);
+	
+	float one = (float)(1 << FIXED_SHIFT);
+	int64_t ds = (int64_t)(sdx * one);
+	int64_t dt = (int64_t)(tdx * one);
+	
+	TextureSpanFn span = texture_spans[tex->layout == PPM_LAYOUT_TILED][(filter & TEXTURE_WRAP) != 0][(filter & TEXTURE_BILINEAR) != 0];
+	
+	int y;
+	for(y = setup.y_min; y <= setup.y_max; y++) {
+		int x0, x1;
+		
+		if(!tri_span(dest, &setup, y, &x0, &x1)) {
+			continue;
+		}
+		
+		int64_t s = (int64_t)floorf(((sdx * x0) + (sdy * y) + s0) * one);
+		int64_t t = (int64_t)floorf(((tdx * x0) + (tdy * y) + t0) * one);
+		int row = dest->header.height - y;
+		int x = x0;
+		
+		while(x <= x1) {
+			int run;
+			PPM_Pixel* out = ppm_run(dest, x, row, &run);
+			run = min(run, x1 - x + 1);
+			span(out, run, tex, s, t, ds, dt);
+			
+			s += ds * run;
+			t += dt * run;
+			x += run;
+		}
+	}
+}
+
+// One non-horizontal polygon edge, crossing rows y_start .. y_end - 1. x is
+// where it crosses the current row, re-evaluated from the lower endpoint
+// (x0, y0) each row rather than accumulated so long edges don't drift. dir is
+// +1 for edges going up, -1 for edges going down.
+typedef struct {
+	float x;
+	float x0;
+	float y0;
+	float dxdy;
+	int y_start;
+	int y_end;
+	int dir;
+} PolyEdge;
+
+static int compare_edge_start(const void* l, const void* r)
+{
+	return ((const PolyEdge*)l)->y_start - ((const PolyEdge*)r)->y_start;
+}
+
+void draw_polygon(Image* image, const Point2D* pts, int n, ColorRGB color, float alpha, FillRule fill_rule)
+{
+	if(n < 3 || alpha <= 0) {
+		return;
+	}
+	
+	PolyEdge* edges = malloc(sizeof(PolyEdge) * n);
+	PolyEdge** active = malloc(sizeof(PolyEdge*) * n);
+	
+	if(!edges || !active) {
+		fprintf(stderr, "Error: failed to allocate polygon edge table.\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	// Edge table: rows are sampled at integer y and each edge covers the
+	// half-open range [y_low, y_high), so a vertex shared by two edges is
+	// counted once and polygons sharing an edge never both fill a pixel.
+	int n_edges = 0;
+	
+	int i;
+	for(i = 0; i < n; i++) {
+		Point2D a = pts[i];
+		Point2D b = pts[(i + 1) % n];
+		int dir = 1;
+		
+		if(a.y > b.y) {
+			Point2D tmp = a;
+			a = b;
+			b = tmp;
+			dir = -1;
+		}
+		
+		int y_start = max((int)ceilf(a.y), 1);
+		int y_end = min((int)ceilf(b.y), image->header.height + 1);
+		
+		if(y_start >= y_end) {
+			continue;
+		}
+		
+		float dxdy = (b.x - a.x) / (b.y - a.y);
+		edges[n_edges++] = (PolyEdge) { 0, a.x, a.y, dxdy, y_start, y_end, dir };
+	}
+	
+	qsort(edges, n_edges, sizeof(PolyEdge), compare_edge_start);
+	
+	int n_active = 0;
+	int next = 0;
+	int y = 0;
+	
+	while(true) {
+		// Retire edges that ended below this row and pick up the ones that
+		// start on it, skipping straight past rows that nothing crosses.
+		int j, k;
+		for(j = 0, k = 0; j < n_active; j++) {
+			if(active[j]->y_end > y) {
+				active[k++] = active[j];
+			}
+		}
+		n_active = k;
+		
+		if(n_active == 0) {
+			if(next == n_edges) {
+				break;
+			}
+			y = edges[next].y_start;
+		}
+		
+		while(next < n_edges && edges[next].y_start == y) {
+			active[n_active++] = &edges[next++];
+		}
+		
+		for(j = 0; j < n_active; j++) {
+			active[j]->x = active[j]->x0 + ((y - active[j]->y0) * active[j]->dxdy);
+		}
+		
+		// The list stays nearly sorted from row to row, so insertion sort only
+		// moves the edges that crossed.
+		for(j = 1; j < n_active; j++) {
+			PolyEdge* e = active[j];
+			
+			for(k = j; k > 0 && active[k - 1]->x > e->x; k--) {
+				active[k] = active[k - 1];
+			}
+			active[k] = e;
+		}
+		
+		// Pixel centres on integer x; a span covers left <= x < right.
+		int winding = 0;
+		for(j = 0; j + 1 < n_active; j++) {
+			winding += (fill_rule == FILL_EVEN_ODD) ? 1 : active[j]->dir;
+			
+			bool inside = (fill_rule == FILL_EVEN_ODD) ? (winding & 1) : (winding != 0);
+			
+			if(inside) {
+				int x0 = max((int)ceilf(active[j]->x), 0);
+				int x1 = min((int)ceilf(active[j + 1]->x) - 1, image->header.width - 1);
+				
+				if(x0 <= x1) {
+					blend_row(image, image->header.height - y, x0, x1, color, alpha, NULL);
 				}
 			}
 		}
+		
+		y++;
+	}
+	
+	free(edges);
+	free(active);
+}
+
+// Anti-aliasing. Coverage is estimated analytically per pixel and the edge
+// pixels go through the coverage span kernels, each blended exactly once.
+
+static uint8_t coverage_byte(float coverage)
+{
+	return (uint8_t)clamp((int)((coverage * 255) + 0.5f), 0, 255);
+}
+
+static uint8_t* alloc_coverage(const Image* image)
+{
+	uint8_t* coverage = malloc(image->header.width);
+	
+	if(!coverage) {
+		fprintf(stderr, "Error: failed to allocate coverage buffer.\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	return coverage;
+}
+
+// Clips [x0, x1] on library row y to the image. Returns false if nothing is
+// left.
+static bool clip_span(const Image* image, int y, int* x0, int* x1)
+{
+	if(y < 1 || y > image->header.height) {
+		return false;
 	}
+	
+	*x0 = max(*x0, 0);
+	*x1 = min(*x1, image->header.width - 1);
+	
+	return *x0 <= *x1;
+}
+
+static void plot_aa(Image* image, bool steep, int x, int y, float coverage, ColorRGB color, float alpha)
+{
+	if(steep) {
+		int tmp = x;
+		x = y;
+		y = tmp;
+	}
+	
+	uint8_t cov = coverage_byte(coverage);
+	
+	if(cov > 0 && clip_span(image, y, &x, &x)) {
+		blend_row(image, image->header.height - y, x, x, color, alpha, &cov);
+	}
+}
+
+// Plots column x of a line that covers a span of width across the minor axis,
+// centred on y + 0.5 as in Wu's algorithm. Each pixel gets its overlap with
+// the span times scale, so a column always adds up to width * scale.
+static void plot_aa_column(Image* image, bool steep, int x, float y, float width, float scale, ColorRGB color, float alpha)
+{
+	float lo = y - ((width - 1) / 2);
+	float hi = lo + width;
+	
+	int row;
+	for(row = (int)floorf(lo); row < hi; row++) {
+		float overlap = fminf(hi, row + 1) - fmaxf(lo, row);
+		plot_aa(image, steep, x, row, overlap * scale, color, alpha);
+	}
+}
+
+// Xiaolin Wu's line: along the major axis each column gets the two pixels
+// straddling the line, weighted by how close the line passes to each. The end
+// columns are also weighted by how much of them the line covers.
+void draw_line_aa(Image* image, Point2D p1, Point2D p2, ColorRGB color, float alpha)
+{
+	bool steep = fabsf(p2.y - p1.y) > fabsf(p2.x - p1.x);
+	
+	if(steep) {
+		swap(&p1.x, &p1.y);
+		swap(&p2.x, &p2.y);
+	}
+	
+	if(p1.x > p2.x) {
+		swap(&p1.x, &p2.x);
+		swap(&p1.y, &p2.y);
+	}
+	
+	float dx = p2.x - p1.x;
+	float gradient = (dx == 0) ? 1.0f : (p2.y - p1.y) / dx;
+	
+	// A line one pixel thick crosses each column over sqrt(1 + gradient^2)
+	// pixels, which keeps diagonals as bright per unit length as axis lines.
+	float width = (dx == 0) ? 1.0f : sqrtf(1 + (gradient * gradient));
+	
+	float x_end = roundf(p1.x);
+	float y_end = p1.y + (gradient * (x_end - p1.x));
+	float gap = remainder_frac(p1.x + 0.5f);
+	int x1 = (int)x_end;
+	plot_aa_column(image, steep, x1, y_end, width, gap, color, alpha);
+	
+	float y = y_end + gradient;
+	
+	x_end = roundf(p2.x);
+	y_end = p2.y + (gradient * (x_end - p2.x));
+	gap = frac(p2.x + 0.5f);
+	int x2 = (int)x_end;
+	
+	if(x2 > x1) {
+		plot_aa_column(image, steep, x2, y_end, width, gap, color, alpha);
+	}
+	
+	int x;
+	for(x = x1 + 1; x < x2; x++) {
+		plot_aa_column(image, steep, x, y, width, 1.0f, color, alpha);
+		y += gradient;
+	}
+}
+
+// Blends the edge pixels [x0, x1] of library row y, dy above the centre. A
+// disc's coverage falls from 1 to 0 as the distance goes from radius - 0.5
+// to radius + 0.5; an outline is a one pixel wide ring centred on radius.
+static void circle_edge(Image* image, int y, int x0, int x1, float origin_x, float dy, float radius, bool filled, ColorRGB color, float alpha, uint8_t* coverage)
+{
+	if(!clip_span(image, y, &x0, &x1)) {
+		return;
+	}
+	
+	int x;
+	for(x = x0; x <= x1; x++) {
+		float d = sqrtf(((x - origin_x) * (x - origin_x)) + (dy * dy));
+		float c = filled ? radius + 0.5f - d : 1.0f - fabsf(d - radius);
+		coverage[x - x0] = coverage_byte(c);
+	}
+	
+	blend_row(image, image->header.height - y, x0, x1, color, alpha, coverage);
+}
+
+void draw_circle_aa(Image* image, Point2D origin, float radius, ColorRGB color, float alpha, bool filled)
+{
+	// Pixels are touched out to outer. Inside inner a disc is fully covered
+	// and an outline not at all, so those rows only need their two edges.
+	float outer = filled ? radius + 0.5f : radius + 1.0f;
+	float inner = filled ? radius - 0.5f : radius - 1.0f;
+	uint8_t* coverage = alloc_coverage(image);
+	
+	int y_min = max((int)ceilf(origin.y - outer), 1);
+	int y_max = min((int)floorf(origin.y + outer), image->header.height);
+	
+	int y;
+	for(y = y_min; y <= y_max; y++) {
+		float dy = y - origin.y;
+		float outer_half = sqrtf(fmaxf((outer * outer) - (dy * dy), 0));
+		int x0 = (int)ceilf(origin.x - outer_half);
+		int x1 = (int)floorf(origin.x + outer_half);
+		
+		if(inner <= 0 || fabsf(dy) >= inner) {
+			circle_edge(image, y, x0, x1, origin.x, dy, radius, filled, color, alpha, coverage);
+			continue;
+		}
+		
+		float inner_half = sqrtf((inner * inner) - (dy * dy));
+		int i0 = (int)ceilf(origin.x - inner_half);
+		int i1 = (int)floorf(origin.x + inner_half);
+		
+		circle_edge(image, y, x0, i0 - 1, origin.x, dy, radius, filled, color, alpha, coverage);
+		circle_edge(image, y, i1 + 1, x1, origin.x, dy, radius, filled, color, alpha, coverage);
+		
+		if(filled && clip_span(image, y, &i0, &i1)) {
+			blend_row(image, image->header.height - y, i0, i1, color, alpha, NULL);
+		}
+	}
+	
+	free(coverage);
+}
+
+// Coverage of a pixel is estimated from its signed distance to the nearest
+// edge: 1 half a pixel inside, 0 half a pixel outside.
+static void triangle_edge(Image* image, int y, int x0, int x1, const TriSetup* setup, const float* inv_len, ColorRGB color, float alpha, uint8_t* coverage)
+{
+	if(x0 > x1) {
+		return;
+	}
+	
+	int x, i;
+	for(x = x0; x <= x1; x++) {
+		float d = INFINITY;
+		
+		for(i = 0; i < 3; i++) {
+			d = fminf(d, ((setup->ex[i] * x) + (setup->ey[i] * y) + setup->e0[i]) * inv_len[i]);
+		}
+		coverage[x - x0] = coverage_byte(d + 0.5f);
+	}
+	
+	blend_row(image, image->header.height - y, x0, x1, color, alpha, coverage);
+}
+
+void draw_triangle_aa(Image* image, Triangle2D tri, ColorRGB color, float alpha)
+{
+	TriSetup setup;
+	
+	if(((tri.p2.x - tri.p1.x) * (tri.p3.y - tri.p1.y)) == ((tri.p2.y - tri.p1.y) * (tri.p3.x - tri.p1.x))) {
+		return;
+	}
+	
+	// A thin triangle can fall between row centres, which tri_setup()
+	// reports as failure, but the widened edges below may still reach
+	// pixels. The edges themselves are set up either way.
+	tri_setup(image, tri, &setup);
+	
+	// Each edge pushed out and pulled in by half a pixel: outer bounds every
+	// touched pixel and inner the fully covered ones.
+	TriSetup outer = setup;
+	TriSetup inner = setup;
+	float inv_len[3];
+	
+	int i;
+	for(i = 0; i < 3; i++) {
+		float len = sqrtf((setup.ex[i] * setup.ex[i]) + (setup.ey[i] * setup.ey[i]));
+		inv_len[i] = 1.0f / len;
+		outer.e0[i] += 0.5f * len;
+		inner.e0[i] -= 0.5f * len;
+	}
+	
+	Rect2D bounds = tri_bounds(tri);
+	int y_min = max((int)ceilf(bounds.bot_left.y - 0.5f), 1);
+	int y_max = min((int)floorf(bounds.top_right.y + 0.5f), image->header.height);
+	uint8_t* coverage = alloc_coverage(image);
+	
+	int y;
+	for(y = y_min; y <= y_max; y++) {
+		int x0, x1, i0, i1;
+		
+		if(!tri_span(image, &outer, y, &x0, &x1)) {
+			continue;
+		}
+		
+		if(!tri_span(image, &inner, y, &i0, &i1)) {
+			triangle_edge(image, y, x0, x1, &setup, inv_len, color, alpha, coverage);
+			continue;
+		}
+		
+		triangle_edge(image, y, x0, i0 - 1, &setup, inv_len, color, alpha, coverage);
+		triangle_edge(image, y, i1 + 1, x1, &setup, inv_len, color, alpha, coverage);
+		blend_row(image, image->header.height - y, i0, i1, color, alpha, NULL);
+	}
+	
+	free(coverage);
 }
 
 void blit(Image* dest, Rect2D dest_rect, const Image* src, Rect2D src_rect)
@@ -32,29 +32,124 @@ typedef struct {
 	Point2D p3;
 } Triangle2D;
 
-Vec2D vec2(float x, float y);
-Vec3D vec3(float x, float y, float z);
-Point2D point2(float x, float y);
-ColorRGB rgb(int r, int g, int b);
+// Texture sampling options, combined with '|': one filter and one wrap mode.
+typedef enum {
+	TEXTURE_NEAREST = 0,
+	TEXTURE_BILINEAR = 1,
+	TEXTURE_CLAMP = 0,
+	TEXTURE_WRAP = 2
+} TextureFilter;
+
+// Which regions of a self-intersecting polygon count as inside.
+typedef enum {
+	FILL_EVEN_ODD,
+	FILL_NON_ZERO
+} FillRule;
 
-Vec2D vec2_add(Vec2D l, Vec2D r);
-Vec2D vec2_sub(Vec2D l, Vec2D r);
-Vec2D vec2_scale(Vec2D v, float scale);
-float vec2_dot(Vec2D l, Vec2D r);
-float vec2_mag(Vec2D v);
-float vec2_mag_sqr(Vec2D v);
-Vec2D vec2_negate(Vec2D v);
-
-Vec3D vec3_add(Vec3D l, Vec3D r);
-Vec3D vec3_sub(Vec3D l, Vec3D r);
-Vec3D vec3_scale(Vec3D v, float scale);
-float vec3_dot(Vec3D l, Vec3D r);
-Vec3D vec3_cross(Vec3D l, Vec3D r);
-float vec3_mag(Vec3D v);
-float vec3_mag_sqr(Vec3D v);
-Vec3D vec3_negate(Vec3D v);
+ColorRGB rgb(int r, int g, int b);
 
+// The small vector helpers are defined here so calls from other translation
+// units inline; vecmath.h has batch versions over whole arrays.
+static inline Vec2D vec2(float x, float y)
+{
+	return (Vec2D) { x, y };
+}
+
+static inline Vec3D vec3(float x, float y, float z)
+{
+	return (Vec3D) { x, y, z };
+}
+
+static inline Point2D point2(float x, float y)
+{
+	return (Point2D) { x, y };
+}
+
+static inline Vec2D vec2_add(Vec2D l, Vec2D r)
+{
+	return (Vec2D) { l.x + r.x, l.y + r.y };
+}
+
+static inline Vec2D vec2_sub(Vec2D l, Vec2D r)
+{
+	return (Vec2D) { l.x - r.x, l.y - r.y };
+}
+
+static inline Vec2D vec2_scale(Vec2D v, float scale)
+{
+	return (Vec2D) { v.x * scale, v.y * scale };
+}
+
+static inline float vec2_dot(Vec2D l, Vec2D r)
+{
+	return (l.x * r.x) + (l.y * r.y);
+}
+
+static inline float vec2_mag(Vec2D v)
+{
+	return sqrt(vec2_dot(v, v));
+}
+
+static inline float vec2_mag_sqr(Vec2D v)
+{
+	return vec2_dot(v, v);
+}
+
+static inline Vec2D vec2_negate(Vec2D v)
+{
+	return (Vec2D) { -v.x, -v.y };
+}
+
+static inline Vec3D vec3_add(Vec3D l, Vec3D r)
+{
+	return (Vec3D) { l.x + r.x, l.y + r.y, l.z + r.z };
+}
+
+static inline Vec3D vec3_sub(Vec3D l, Vec3D r)
+{
+	return (Vec3D) { l.x - r.x, l.y - r.y, l.z - r.z };
+}
+
+static inline Vec3D vec3_scale(Vec3D v, float scale)
+{
+	return (Vec3D) { v.x * scale, v.y * scale, v.z * scale };
+}
+
+static inline float vec3_dot(Vec3D l, Vec3D r)
+{
+	return (l.x * r.x) + (l.y * r.y) + (l.z * r.z);
+}
+
+static inline Vec3D vec3_cross(Vec3D l, Vec3D r)
+{
+	float vx = (l.y * r.z) - (l.z * r.y);
+	float vy = -((l.x * r.z) - (l.z * r.x));
+	float vz = (l.x * r.y) - (l.y * r.x);
+	
+	return (Vec3D) { vx, vy, vz };
+}
+
+static inline float vec3_mag(Vec3D v)
+{
+	return sqrt(vec3_dot(v, v));
+}
+
+static inline float vec3_mag_sqr(Vec3D v)
+{
+	return vec3_dot(v, v);
+}
+
+static inline Vec3D vec3_negate(Vec3D v)
+{
+	return (Vec3D) { -v.x, -v.y, -v.z };
+}
+
+// blend() mixes the sRGB bytes directly; blend_linear() mixes in linear light
+// through lookup tables. The _alpha drawing functions use the image's
+// blend_mode and blend_space instead.
 ColorRGB blend(ColorRGB bg, ColorRGB fg, float alpha);
+ColorRGB blend_linear(ColorRGB bg, ColorRGB fg, float alpha);
+ColorRGB blend_space(ColorRGB bg, ColorRGB fg, float alpha, PPM_BlendSpace space);
 
 Vec3D barycentric_coords(Triangle2D tri, Point2D point);
 
@@ -70,6 +165,19 @@ void draw_circle_alpha(Image* image, Point2D origin, float radius, ColorRGB colo
 void draw_triangle(Image* image, Triangle2D tri, ColorRGB color, bool filled);
 void draw_triangle_alpha(Image* image, Triangle2D tri, ColorRGB color, float alpha, bool filled);
 
+void draw_triangle_gouraud(Image* image, Triangle2D tri, ColorRGB c1, ColorRGB c2, ColorRGB c3);
+void draw_triangle_textured(Image* dest, Triangle2D tri, const Vec2D* uvs, const Image* tex, TextureFilter filter);
+
+// Fills the polygon pts[0..n-1] in one pass over the rows it covers. Each
+// pixel is written at most once, so translucent polygons blend evenly.
+void draw_polygon(Image* image, const Point2D* pts, int n, ColorRGB color, float alpha, FillRule fill_rule);
+
+// Anti-aliased drawing: edge pixels are blended by their estimated coverage
+// with the image's blend mode and space, each pixel exactly once.
+void draw_line_aa(Image* image, Point2D p1, Point2D p2, ColorRGB color, float alpha);
+void draw_circle_aa(Image* image, Point2D origin, float radius, ColorRGB color, float alpha, bool filled);
+void draw_triangle_aa(Image* image, Triangle2D tri, ColorRGB color, float alpha);
+
 void blit(Image* dest, Rect2D dest_rect, const Image* src, Rect2D src_rect);
 void blit_alpha(Image* dest, Rect2D dest_rect, const Image* src, Rect2D src_rect, float alpha);
 
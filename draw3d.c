@@ -0,0 +1,377 @@
+#include "draw3d.h"
+#include <float.h>
+
+#define DEPTH_TILE PPM_TILE_SIZE
+#define NEAR_EPSILON 1e-5f
+
+typedef struct {
+	float x;
+	float y;
+	float z;
+} ScreenVertex;
+
+Vec4D vec4(float x, float y, float z, float w)
+{
+	return (Vec4D) { x, y, z, w };
+}
+
+Mat4 mat4_identity(void)
+{
+	return (Mat4) { {
+		{ 1, 0, 0, 0 },
+		{ 0, 1, 0, 0 },
+		{ 0, 0, 1, 0 },
+		{ 0, 0, 0, 1 }
+	} };
+}
+
+Mat4 mat4_mul(Mat4 l, Mat4 r)
+{
+	Mat4 out;
+	
+	int i, j;
+	for(i = 0; i < 4; i++) {
+		for(j = 0; j < 4; j++) {
+			out.m[i][j] = (l.m[i][0] * r.m[0][j]) + (l.m[i][1] * r.m[1][j]) +
+				(l.m[i][2] * r.m[2][j]) + (l.m[i][3] * r.m[3][j]);
+		}
+	}
+	
+	return out;
+}
+
+Mat4 mat4_translate(float x, float y, float z)
+{
+	Mat4 out = mat4_identity();
+	out.m[0][3] = x;
+	out.m[1][3] = y;
+	out.m[2][3] = z;
+	
+	return out;
+}
+
+Mat4 mat4_scale(float x, float y, float z)
+{
+	Mat4 out = mat4_identity();
+	out.m[0][0] = x;
+	out.m[1][1] = y;
+	out.m[2][2] = z;
+	
+	return out;
+}
+
+Mat4 mat4_rotate_x(float radians)
+{
+	float c = cosf(radians);
+	float s = sinf(radians);
+	Mat4 out = mat4_identity();
+	out.m[1][1] = c;
+	out.m[1][2] = -s;
+	out.m[2][1] = s;
+	out.m[2][2] = c;
+	
+	return out;
+}
+
+Mat4 mat4_rotate_y(float radians)
+{
+	float c = cosf(radians);
+	float s = sinf(radians);
+	Mat4 out = mat4_identity();
+	out.m[0][0] = c;
+	out.m[0][2] = s;
+	out.m[2][0] = -s;
+	out.m[2][2] = c;
+	
+	return out;
+}
+
+Mat4 mat4_rotate_z(float radians)
+{
+	float c = cosf(radians);
+	float s = sinf(radians);
+	Mat4 out = mat4_identity();
+	out.m[0][0] = c;
+	out.m[0][1] = -s;
+	out.m[1][0] = s;
+	out.m[1][1] = c;
+	
+	return out;
+}
+
+Mat4 mat4_perspective(float fov_y, float aspect, float near, float far)
+{
+	float f = 1.0f / tanf(fov_y * 0.5f);
+	Mat4 out;
+	
+	int i, j;
+	for(i = 0; i < 4; i++) {
+		for(j = 0; j < 4; j++) {
+			out.m[i][j] = 0;
+		}
+	}
+	
+	out.m[0][0] = f / aspect;
+	out.m[1][1] = f;
+	out.m[2][2] = (far + near) / (near - far);
+	out.m[2][3] = (2 * far * near) / (near - far);
+	out.m[3][2] = -1;
+	
+	return out;
+}
+
+Vec4D mat4_transform(Mat4 m, Vec4D v)
+{
+	return (Vec4D) {
+		(m.m[0][0] * v.x) + (m.m[0][1] * v.y) + (m.m[0][2] * v.z) + (m.m[0][3] * v.w),
+		(m.m[1][0] * v.x) + (m.m[1][1] * v.y) + (m.m[1][2] * v.z) + (m.m[1][3] * v.w),
+		(m.m[2][0] * v.x) + (m.m[2][1] * v.y) + (m.m[2][2] * v.z) + (m.m[2][3] * v.w),
+		(m.m[3][0] * v.x) + (m.m[3][1] * v.y) + (m.m[3][2] * v.z) + (m.m[3][3] * v.w)
+	};
+}
+
+void depth_attach(Image* image)
+{
+	if(image->depth) {
+		return;
+	}
+	
+	DepthBuffer* depth = malloc(sizeof(DepthBuffer));
+	
+	if(!depth) {
+		fprintf(stderr, "Error: failed to allocate depth buffer.\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	depth->tiles_x = (image->header.width + DEPTH_TILE - 1) / DEPTH_TILE;
+	depth->tiles_y = (image->header.height + DEPTH_TILE - 1) / DEPTH_TILE;
+	depth->values = malloc(sizeof(float) * (size_t)image->header.width * image->header.height);
+	depth->tile_max = malloc(sizeof(float) * depth->tiles_x * depth->tiles_y);
+	
+	if(!depth->values || !depth->tile_max) {
+		fprintf(stderr, "Error: failed to allocate depth buffer.\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	image->depth = depth;
+	depth_clear(image);
+}
+
+void depth_clear(Image* image)
+{
+	DepthBuffer* depth = image->depth;
+	
+	if(!depth) {
+		return;
+	}
+	
+	size_t n_values = (size_t)image->header.width * image->header.height;
+	
+	size_t i;
+	for(i = 0; i < n_values; i++) {
+		depth->values[i] = FLT_MAX;
+	}
+	
+	for(i = 0; i < (size_t)depth->tiles_x * depth->tiles_y; i++) {
+		depth->tile_max[i] = FLT_MAX;
+	}
+}
+
+void depth_detach(Image* image)
+{
+	if(image->depth) {
+		free(image->depth->values);
+		free(image->depth->tile_max);
+		free(image->depth);
+		image->depth = NULL;
+	}
+}
+
+static ScreenVertex to_screen(const Image* image, Vec4D v)
+{
+	float inv_w = 1.0f / v.w;
+	
+	return (ScreenVertex) {
+		((v.x * inv_w) + 1.0f) * 0.5f * image->header.width,
+		(1.0f - (v.y * inv_w)) * 0.5f * image->header.height,
+		((v.z * inv_w) * 0.5f) + 0.5f
+	};
+}
+
+// Clips the polygon against the near plane z >= -w. A triangle becomes at
+// most a quad, so out needs room for four vertices.
+static int clip_near(const Vec4D* in, int n, Vec4D* out)
+{
+	int count = 0;
+	
+	int i;
+	for(i = 0; i < n; i++) {
+		Vec4D a = in[i];
+		Vec4D b = in[(i + 1) % n];
+		float da = a.z + a.w;
+		float db = b.z + b.w;
+		
+		if(da >= 0) {
+			out[count++] = a;
+		}
+		
+		if((da >= 0) != (db >= 0)) {
+			float t = da / (da - db);
+			out[count++] = (Vec4D) {
+				a.x + (b.x - a.x) * t,
+				a.y + (b.y - a.y) * t,
+				a.z + (b.z - a.z) * t,
+				a.w + (b.w - a.w) * t
+			};
+		}
+	}
+	
+	return count;
+}
+
+static void update_tile_max(Image* image, int tx, int ty)
+{
+	DepthBuffer* depth = image->depth;
+	int x0 = tx * DEPTH_TILE;
+	int y0 = ty * DEPTH_TILE;
+	int x1 = min(x0 + DEPTH_TILE, image->header.width);
+	int y1 = min(y0 + DEPTH_TILE, image->header.height);
+	float farthest = 0;
+	
+	int x, y;
+	for(y = y0; y < y1; y++) {
+		const float* row = &depth->values[(size_t)y * image->header.width];
+		
+		for(x = x0; x < x1; x++) {
+			farthest = (row[x] > farthest) ? row[x] : farthest;
+		}
+	}
+	
+	depth->tile_max[(ty * depth->tiles_x) + tx] = farthest;
+}
+
+static void raster_triangle(Image* image, ScreenVertex a, ScreenVertex b, ScreenVertex c, ColorRGB color)
+{
+	float area = ((b.x - a.x) * (c.y - a.y)) - ((b.y - a.y) * (c.x - a.x));
+	
+	if(area == 0) {
+		return;
+	}
+	
+	if(area < 0) {
+		ScreenVertex tmp = b;
+		b = c;
+		c = tmp;
+		area = -area;
+	}
+	
+	// Edge functions e(x, y) = ex * x + ey * y + e0, positive inside.
+	float e1x = a.y - b.y, e1y = b.x - a.x, e10 = (a.x * b.y) - (a.y * b.x);
+	float e2x = b.y - c.y, e2y = c.x - b.x, e20 = (b.x * c.y) - (b.y * c.x);
+	float e3x = c.y - a.y, e3y = a.x - c.x, e30 = (c.x * a.y) - (c.y * a.x);
+	
+	// Depth plane z(x, y) = zx * x + zy * y + z0 from the barycentric weights.
+	float inv_area = 1.0f / area;
+	float zx = ((e2x * a.z) + (e3x * b.z) + (e1x * c.z)) * inv_area;
+	float zy = ((e2y * a.z) + (e3y * b.z) + (e1y * c.z)) * inv_area;
+	float z0 = ((e20 * a.z) + (e30 * b.z) + (e10 * c.z)) * inv_area;
+	
+	float min_z = fminf(a.z, fminf(b.z, c.z));
+	
+	if(min_z > 1.0f) {
+		return;
+	}
+	
+	int x_min = max(0, (int)floorf(fminf(a.x, fminf(b.x, c.x))));
+	int y_min = max(0, (int)floorf(fminf(a.y, fminf(b.y, c.y))));
+	int x_max = min(image->header.width - 1, (int)ceilf(fmaxf(a.x, fmaxf(b.x, c.x))));
+	int y_max = min(image->header.height - 1, (int)ceilf(fmaxf(a.y, fmaxf(b.y, c.y))));
+	
+	if(x_min > x_max || y_min > y_max) {
+		return;
+	}
+	
+	DepthBuffer* depth = image->depth;
+	int width = image->header.width;
+	
+	int tx, ty;
+	for(ty = y_min / DEPTH_TILE; ty <= y_max / DEPTH_TILE; ty++) {
+		for(tx = x_min / DEPTH_TILE; tx <= x_max / DEPTH_TILE; tx++) {
+			// Hierarchical-Z: everything already in this block is nearer than
+			// the nearest point of the triangle.
+			if(min_z >= depth->tile_max[(ty * depth->tiles_x) + tx]) {
+				continue;
+			}
+			
+			int bx0 = max(tx * DEPTH_TILE, x_min);
+			int by0 = max(ty * DEPTH_TILE, y_min);
+			int bx1 = min((tx * DEPTH_TILE) + DEPTH_TILE - 1, x_max);
+			int by1 = min((ty * DEPTH_TILE) + DEPTH_TILE - 1, y_max);
+			bool written = false;
+			
+			int x, y;
+			for(y = by0; y <= by1; y++) {
+				float py = y + 0.5f;
+				float px = bx0 + 0.5f;
+				float w1 = (e1x * px) + (e1y * py) + e10;
+				float w2 = (e2x * px) + (e2y * py) + e20;
+				float w3 = (e3x * px) + (e3y * py) + e30;
+				float z = (zx * px) + (zy * py) + z0;
+				float* zrow = &depth->values[(size_t)y * width];
+				// Depth blocks line up with the 8x8 tiles of a tiled image,
+				// so a block row is always one contiguous run.
+				int run;
+				PPM_Pixel* row = ppm_run(image, bx0, y, &run);
+				
+				for(x = bx0; x <= bx1; x++) {
+					if(w1 >= 0 && w2 >= 0 && w3 >= 0 && z < zrow[x] && z <= 1.0f) {
+						zrow[x] = z;
+						row[x - bx0] = color;
+						written = true;
+					}
+					
+					w1 += e1x;
+					w2 += e2x;
+					w3 += e3x;
+					z += zx;
+				}
+			}
+			
+			if(written) {
+				update_tile_max(image, tx, ty);
+			}
+		}
+	}
+}
+
+void draw_triangle3d(Image* image, const Mat4* transform, Triangle3D tri, ColorRGB color)
+{
+	Vec4D clip[3] = {
+		mat4_transform(*transform, vec4(tri.p1.x, tri.p1.y, tri.p1.z, 1)),
+		mat4_transform(*transform, vec4(tri.p2.x, tri.p2.y, tri.p2.z, 1)),
+		mat4_transform(*transform, vec4(tri.p3.x, tri.p3.y, tri.p3.z, 1))
+	};
+	
+	Vec4D clipped[4];
+	int n = clip_near(clip, 3, clipped);
+	
+	if(n < 3) {
+		return;
+	}
+	
+	depth_attach(image);
+	
+	ScreenVertex screen[4];
+	
+	int i;
+	for(i = 0; i < n; i++) {
+		if(clipped[i].w < NEAR_EPSILON) {
+			clipped[i].w = NEAR_EPSILON;
+		}
+		screen[i] = to_screen(image, clipped[i]);
+	}
+	
+	for(i = 1; i + 1 < n; i++) {
+		raster_triangle(image, screen[0], screen[i], screen[i + 1], color);
+	}
+}
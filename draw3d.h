@@ -0,0 +1,49 @@
+#ifndef DRAW3D_H
+#define DRAW3D_H
+
+#include "draw.h"
+
+typedef struct {
+	float x;
+	float y;
+	float z;
+	float w;
+} Vec4D;
+
+// Row-major 4x4 matrix applied to column vectors: clip = m * position.
+typedef struct {
+	float m[4][4];
+} Mat4;
+
+typedef struct {
+	Point3D p1;
+	Point3D p2;
+	Point3D p3;
+} Triangle3D;
+
+typedef PPM_Depth DepthBuffer;
+
+Vec4D vec4(float x, float y, float z, float w);
+
+Mat4 mat4_identity(void);
+Mat4 mat4_mul(Mat4 l, Mat4 r);
+Mat4 mat4_translate(float x, float y, float z);
+Mat4 mat4_scale(float x, float y, float z);
+Mat4 mat4_rotate_x(float radians);
+Mat4 mat4_rotate_y(float radians);
+Mat4 mat4_rotate_z(float radians);
+Mat4 mat4_perspective(float fov_y, float aspect, float near, float far);
+Vec4D mat4_transform(Mat4 m, Vec4D v);
+
+// Attaches a depth buffer cleared to the far plane if the image has none.
+void depth_attach(Image* image);
+void depth_clear(Image* image);
+void depth_detach(Image* image);
+
+// Transforms tri into clip space (OpenGL conventions, -w <= z <= w visible),
+// clips it against the near plane and rasterises it with a depth test,
+// attaching a depth buffer first if needed. Blocks of 8x8 pixels whose stored
+// depths are all nearer than the triangle are skipped before any pixel work.
+void draw_triangle3d(Image* image, const Mat4* transform, Triangle3D tri, ColorRGB color);
+
+#endif //DRAW3D_H
@@ -0,0 +1,450 @@
+#include "filter.h"
+#include "pool.h"
+#include <string.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#define FILTER_SSE 1
+#endif
+
+#define TRANSPOSE_BLOCK 16
+#define BOX_PASSES 3
+
+// Rows are handed to the row filters in groups of this many, one per SSE lane.
+#define ROW_GROUP 4
+
+// Filters n_rows consecutive rows of n pixels, each held as interleaved r, g,
+// b floats, in place. pad is scratch for two copies of ROW_GROUP rows with
+// edge pixels repeated either side.
+typedef void (*RowFilterFn)(float* rows, int n_rows, int n, float* pad, const void* params);
+
+typedef struct {
+	const float* taps;
+	int radius;
+} ConvolveParams;
+
+typedef struct {
+	int radii[BOX_PASSES];
+	int n_passes;
+} BoxParams;
+
+// Working state for one filter call. rows holds the image as floats in row
+// order and columns its transpose; pads and pixels are per-thread scratch.
+typedef struct {
+	const Image* src;
+	Image* dest;
+	int width;
+	int height;
+	float* rows;
+	float* columns;
+	RowFilterFn fn;
+	const void* params;
+	float* pads;
+	size_t pad_len;
+	PPM_Pixel* pixels;
+	const float* in;
+	float* out;
+	int in_width;
+	int in_height;
+} FilterJob;
+
+// out[i] += in[i] * w, four lanes at a time where SSE is available.
+static void axpy_floats(float* out, const float* in, float w, size_t n)
+{
+	size_t i = 0;
+
+#ifdef FILTER_SSE
+	__m128 vw = _mm_set1_ps(w);
+	for(; i + 4 <= n; i += 4) {
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_loadu_ps(in + i), vw)));
+	}
+#endif
+	
+	for(; i < n; i++) {
+		out[i] += in[i] * w;
+	}
+}
+
+static void pad_row(float* pad, const float* row, int n, int radius)
+{
+	int i;
+	for(i = 0; i < radius; i++) {
+		memcpy(&pad[i * 3], &row[0], sizeof(float) * 3);
+		memcpy(&pad[(radius + n + i) * 3], &row[(n - 1) * 3], sizeof(float) * 3);
+	}
+	
+	memcpy(&pad[radius * 3], row, sizeof(float) * 3 * n);
+}
+
+// Each tap scales a shifted copy of the padded row into the output, so the
+// inner loop runs straight across pixels and channels.
+static void convolve_row(float* rows, int n_rows, int n, float* pad, const void* params)
+{
+	const ConvolveParams* p = params;
+	size_t len = (size_t)n * 3;
+	
+	int y;
+	for(y = 0; y < n_rows; y++) {
+		float* row = &rows[y * len];
+		
+		pad_row(pad, row, n, p->radius);
+		memset(row, 0, sizeof(float) * len);
+		
+		int k;
+		for(k = 0; k <= 2 * p->radius; k++) {
+			axpy_floats(row, &pad[k * 3], p->taps[k], len);
+		}
+	}
+}
+
+// Sliding-window mean: each step adds the pixel entering the window and drops
+// the one leaving it.
+static void box_row_pass(float* row, int n, float* pad, int radius)
+{
+	int size = (2 * radius) + 1;
+	float inv = 1.0f / size;
+	float sum[3] = { 0, 0, 0 };
+	
+	pad_row(pad, row, n, radius);
+	
+	int i, c;
+	for(i = 0; i < size - 1; i++) {
+		for(c = 0; c < 3; c++) {
+			sum[c] += pad[(i * 3) + c];
+		}
+	}
+	
+	for(i = 0; i < n; i++) {
+		for(c = 0; c < 3; c++) {
+			sum[c] += pad[((i + size - 1) * 3) + c];
+			row[(i * 3) + c] = sum[c] * inv;
+			sum[c] -= pad[(i * 3) + c];
+		}
+	}
+}
+
+#ifdef FILTER_SSE
+// Transposes between ROW_GROUP rows of len floats and len vectors holding one
+// float of each row, a 4x4 block at a time.
+static void interleave_rows(float* out, const float* rows, size_t len)
+{
+	size_t j = 0;
+	for(; j + 4 <= len; j += 4) {
+		__m128 r0 = _mm_loadu_ps(&rows[j]);
+		__m128 r1 = _mm_loadu_ps(&rows[len + j]);
+		__m128 r2 = _mm_loadu_ps(&rows[(2 * len) + j]);
+		__m128 r3 = _mm_loadu_ps(&rows[(3 * len) + j]);
+		_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+		_mm_storeu_ps(&out[j * 4], r0);
+		_mm_storeu_ps(&out[(j + 1) * 4], r1);
+		_mm_storeu_ps(&out[(j + 2) * 4], r2);
+		_mm_storeu_ps(&out[(j + 3) * 4], r3);
+	}
+	
+	for(; j < len; j++) {
+		_mm_storeu_ps(&out[j * 4], _mm_setr_ps(rows[j], rows[len + j], rows[(2 * len) + j], rows[(3 * len) + j]));
+	}
+}
+
+static void deinterleave_rows(float* rows, const float* in, size_t len)
+{
+	size_t j = 0;
+	for(; j + 4 <= len; j += 4) {
+		__m128 r0 = _mm_loadu_ps(&in[j * 4]);
+		__m128 r1 = _mm_loadu_ps(&in[(j + 1) * 4]);
+		__m128 r2 = _mm_loadu_ps(&in[(j + 2) * 4]);
+		__m128 r3 = _mm_loadu_ps(&in[(j + 3) * 4]);
+		_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+		_mm_storeu_ps(&rows[j], r0);
+		_mm_storeu_ps(&rows[len + j], r1);
+		_mm_storeu_ps(&rows[(2 * len) + j], r2);
+		_mm_storeu_ps(&rows[(3 * len) + j], r3);
+	}
+	
+	for(; j < len; j++) {
+		int lane;
+		for(lane = 0; lane < ROW_GROUP; lane++) {
+			rows[(lane * len) + j] = in[(j * 4) + lane];
+		}
+	}
+}
+
+// Runs every box pass over ROW_GROUP rows at once, one row per lane. The rows
+// are interleaved into pad so each channel of a pixel is a single vector, and
+// each pass slides its window from one half of pad into the other, adding in
+// the same order as box_row_pass.
+static void box_row_group(float* rows, int n, float* pad, const BoxParams* p)
+{
+	size_t len = (size_t)n * 3;
+	int margin = 0;
+	
+	int i, c, k;
+	for(k = 0; k < p->n_passes; k++) {
+		margin = max(margin, p->radii[k]);
+	}
+	
+	float* in = &pad[margin * 3 * ROW_GROUP];
+	float* out = &in[(n + (2 * margin)) * 3 * ROW_GROUP];
+	
+	interleave_rows(in, rows, len);
+	
+	for(k = 0; k < p->n_passes; k++) {
+		int radius = p->radii[k];
+		__m128 inv = _mm_set1_ps(1.0f / ((2 * radius) + 1));
+		__m128 sum[3];
+		
+		for(i = 1; i <= radius; i++) {
+			memcpy(&in[-i * 3 * ROW_GROUP], in, sizeof(float) * 3 * ROW_GROUP);
+			memcpy(&in[(n - 1 + i) * 3 * ROW_GROUP], &in[(n - 1) * 3 * ROW_GROUP], sizeof(float) * 3 * ROW_GROUP);
+		}
+		
+		for(c = 0; c < 3; c++) {
+			sum[c] = _mm_setzero_ps();
+			
+			for(i = -radius; i < radius; i++) {
+				sum[c] = _mm_add_ps(sum[c], _mm_loadu_ps(&in[((i * 3) + c) * ROW_GROUP]));
+			}
+		}
+		
+		for(i = 0; i < n; i++) {
+			for(c = 0; c < 3; c++) {
+				sum[c] = _mm_add_ps(sum[c], _mm_loadu_ps(&in[(((i + radius) * 3) + c) * ROW_GROUP]));
+				_mm_storeu_ps(&out[((i * 3) + c) * ROW_GROUP], _mm_mul_ps(sum[c], inv));
+				sum[c] = _mm_sub_ps(sum[c], _mm_loadu_ps(&in[(((i - radius) * 3) + c) * ROW_GROUP]));
+			}
+		}
+		
+		float* tmp = in;
+		in = out;
+		out = tmp;
+	}
+	
+	deinterleave_rows(rows, in, len);
+}
+#endif
+
+static void box_row(float* rows, int n_rows, int n, float* pad, const void* params)
+{
+	const BoxParams* p = params;
+	size_t len = (size_t)n * 3;
+	int y = 0;
+	
+#ifdef FILTER_SSE
+	for(; y + ROW_GROUP <= n_rows; y += ROW_GROUP) {
+		box_row_group(&rows[y * len], n, pad, p);
+	}
+#endif
+	
+	for(; y < n_rows; y++) {
+		int i;
+		for(i = 0; i < p->n_passes; i++) {
+			box_row_pass(&rows[y * len], n, pad, p->radii[i]);
+		}
+	}
+}
+
+static bool load_rows(int begin, int end, void* ctx)
+{
+	FilterJob* job = ctx;
+	int t = pool_thread_index();
+	PPM_Pixel* pixels = &job->pixels[(size_t)t * job->width];
+	float* pad = &job->pads[t * job->pad_len * ROW_GROUP * 2];
+	
+	int x, y, first;
+	for(first = begin; first < end; first += ROW_GROUP) {
+		int n_rows = min(ROW_GROUP, end - first);
+		
+		for(y = first; y < first + n_rows; y++) {
+			float* row = &job->rows[(size_t)y * job->width * 3];
+			ppm_read_row(job->src, y, pixels);
+			
+			for(x = 0; x < job->width; x++) {
+				row[(x * 3)] = pixels[x].r;
+				row[(x * 3) + 1] = pixels[x].g;
+				row[(x * 3) + 2] = pixels[x].b;
+			}
+		}
+		
+		job->fn(&job->rows[(size_t)first * job->width * 3], n_rows, job->width, pad, job->params);
+	}
+	
+	return true;
+}
+
+static bool filter_columns(int begin, int end, void* ctx)
+{
+	FilterJob* job = ctx;
+	float* pad = &job->pads[pool_thread_index() * job->pad_len * ROW_GROUP * 2];
+	
+	int x;
+	for(x = begin; x < end; x += ROW_GROUP) {
+		job->fn(&job->columns[(size_t)x * job->height * 3], min(ROW_GROUP, end - x), job->height, pad, job->params);
+	}
+	
+	return true;
+}
+
+static bool store_rows(int begin, int end, void* ctx)
+{
+	FilterJob* job = ctx;
+	PPM_Pixel* pixels = &job->pixels[(size_t)pool_thread_index() * job->width];
+	
+	int x, y;
+	for(y = begin; y < end; y++) {
+		const float* row = &job->rows[(size_t)y * job->width * 3];
+		
+		for(x = 0; x < job->width; x++) {
+			pixels[x] = (PPM_Pixel) {
+				(uint8_t)clamp((int)(row[(x * 3)] + 0.5f), 0, 255),
+				(uint8_t)clamp((int)(row[(x * 3) + 1] + 0.5f), 0, 255),
+				(uint8_t)clamp((int)(row[(x * 3) + 2] + 0.5f), 0, 255)
+			};
+		}
+		
+		ppm_write_row(job->dest, y, pixels);
+	}
+	
+	return true;
+}
+
+// Transposes the block rows [begin, end) of in, an in_width x in_height grid
+// of pixels, into out. Working a block at a time keeps both the reads and the
+// strided writes within a few cache lines.
+static bool transpose_blocks(int begin, int end, void* ctx)
+{
+	FilterJob* job = ctx;
+	int w = job->in_width;
+	int h = job->in_height;
+	
+	int bx, by, x, y;
+	for(by = begin * TRANSPOSE_BLOCK; by < min(end * TRANSPOSE_BLOCK, h); by += TRANSPOSE_BLOCK) {
+		int y_end = min(by + TRANSPOSE_BLOCK, h);
+		
+		for(bx = 0; bx < w; bx += TRANSPOSE_BLOCK) {
+			int x_end = min(bx + TRANSPOSE_BLOCK, w);
+			
+			for(x = bx; x < x_end; x++) {
+				float* out = &job->out[(((size_t)x * h) + by) * 3];
+				
+				for(y = by; y < y_end; y++) {
+					const float* in = &job->in[(((size_t)y * w) + x) * 3];
+					*out++ = in[0];
+					*out++ = in[1];
+					*out++ = in[2];
+				}
+			}
+		}
+	}
+	
+	return true;
+}
+
+static void transpose(FilterJob* job, const float* in, float* out, int w, int h)
+{
+	job->in = in;
+	job->out = out;
+	job->in_width = w;
+	job->in_height = h;
+	
+	int n_blocks = (h + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK;
+	parallel_for(0, n_blocks, 1, transpose_blocks, job);
+}
+
+// Runs fn along every row with params_x, then along every column with
+// params_y. The image is converted to floats once, so the passes don't round
+// to bytes in between.
+static void filter_separable(Image* dest, const Image* src, RowFilterFn fn, const void* params_x, const void* params_y, int max_radius)
+{
+	if(dest->header.width != src->header.width || dest->header.height != src->header.height) {
+		fprintf(stderr, "Error: filter source and destination sizes differ.\n");
+		return;
+	}
+	
+	int width = src->header.width;
+	int height = src->header.height;
+	int n_threads = pool_thread_count();
+	size_t n_floats = (size_t)width * height * 3;
+	
+	FilterJob job;
+	memset(&job, 0, sizeof(job));
+	job.src = src;
+	job.dest = dest;
+	job.width = width;
+	job.height = height;
+	job.pad_len = (size_t)(max(width, height) + (2 * max_radius)) * 3;
+	job.rows = malloc(sizeof(float) * n_floats);
+	job.columns = malloc(sizeof(float) * n_floats);
+	job.pads = malloc(sizeof(float) * job.pad_len * ROW_GROUP * 2 * n_threads);
+	job.pixels = malloc(sizeof(PPM_Pixel) * width * n_threads);
+	
+	if(!job.rows || !job.columns || !job.pads || !job.pixels) {
+		fprintf(stderr, "Error: failed to allocate filter buffers.\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	job.fn = fn;
+	job.params = params_x;
+	parallel_for(0, height, max(1, height / (n_threads * 4)), load_rows, &job);
+	
+	transpose(&job, job.rows, job.columns, width, height);
+	
+	job.params = params_y;
+	parallel_for(0, width, max(1, width / (n_threads * 4)), filter_columns, &job);
+	
+	transpose(&job, job.columns, job.rows, height, width);
+	
+	parallel_for(0, height, max(1, height / (n_threads * 4)), store_rows, &job);
+	
+	free(job.rows);
+	free(job.columns);
+	free(job.pads);
+	free(job.pixels);
+}
+
+void filter_convolve(Image* dest, const Image* src, const float* kernel_x, int radius_x, const float* kernel_y, int radius_y)
+{
+	if(radius_x < 0 || radius_y < 0) {
+		fprintf(stderr, "Error: negative convolution radius.\n");
+		return;
+	}
+	
+	ConvolveParams px = { kernel_x, radius_x };
+	ConvolveParams py = { kernel_y, radius_y };
+	
+	filter_separable(dest, src, convolve_row, &px, &py, max(radius_x, radius_y));
+}
+
+void filter_box_blur(Image* dest, const Image* src, int radius)
+{
+	BoxParams p = { { max(radius, 0) }, 1 };
+	
+	filter_separable(dest, src, box_row, &p, &p, p.radii[0]);
+}
+
+// Box widths whose three-fold convolution has variance closest to sigma^2:
+// the passes use the odd widths either side of the ideal one.
+void filter_gaussian_blur(Image* dest, const Image* src, float sigma)
+{
+	BoxParams p;
+	p.n_passes = BOX_PASSES;
+	
+	float variance = 12 * sigma * sigma;
+	int lower = (int)floorf(sqrtf((variance / BOX_PASSES) + 1));
+	
+	if(lower % 2 == 0) {
+		lower--;
+	}
+	
+	int n_lower = (int)roundf((variance - (BOX_PASSES * lower * lower) - (4 * BOX_PASSES * lower) - (3 * BOX_PASSES)) / ((-4 * lower) - 4));
+	
+	int max_radius = 0;
+	
+	int i;
+	for(i = 0; i < BOX_PASSES; i++) {
+		int size = (i < n_lower) ? lower : lower + 2;
+		p.radii[i] = (size - 1) / 2;
+		max_radius = max(max_radius, p.radii[i]);
+	}
+	
+	filter_separable(dest, src, box_row, &p, &p, max_radius);
+}
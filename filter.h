@@ -0,0 +1,25 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "draw.h"
+
+// Post-processing filters. Each reads src and writes dest, which must have
+// the same dimensions but may use a different layout; dest may also be src
+// itself. Pixels beyond the edges repeat the nearest edge pixel. Rows are
+// filtered in parallel on the shared pool, and the vertical pass runs on a
+// transposed copy so it streams through memory the same way.
+
+// Separable convolution: kernel_x has 2 * radius_x + 1 taps applied along
+// rows and kernel_y has 2 * radius_y + 1 taps applied along columns. Taps are
+// used as given, so normalise them to keep brightness.
+void filter_convolve(Image* dest, const Image* src, const float* kernel_x, int radius_x, const float* kernel_y, int radius_y);
+
+// Mean over a (2 * radius + 1) square, at a cost per pixel that does not
+// depend on the radius.
+void filter_box_blur(Image* dest, const Image* src, int radius);
+
+// Approximates a Gaussian of standard deviation sigma with three box passes
+// in each direction.
+void filter_gaussian_blur(Image* dest, const Image* src, float sigma);
+
+#endif //FILTER_H
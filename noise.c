@@ -0,0 +1,85 @@
+#include "noise.h"
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static int floor_i(float f)
+{
+	return (int)(f);
+}
+
+static float frac(float f)
+{
+	if(f < 0) {
+		return 1.0f - (f - floor_i(f));
+	}
+	
+	return f - floor_i(f);
+}
+
+float noise_2D(int x, int y)
+{
+	int n = x + y * 57;
+	n = (n << 13) ^ n;
+	return 1.0f - ( ((n * (n * n * 15731 + 789221) + 1376312589) & 0x7FFFFFFF) / 1073741824.0f);
+}
+
+float smooth_noise_2D(int x, int y)
+{
+	int x0 = x-1;
+	int x1 = x+1;
+	int y0 = y-1;
+	int y1 = y+1;
+	
+	float corners = (noise_2D(x0, y0) + noise_2D(x1, y0) + noise_2D(x0, y1) + noise_2D(x1, y1)) / 16.0f;
+	float sides = (noise_2D(x0, y) + noise_2D(x1, y) + noise_2D(x, y0) + noise_2D(x, y1)) / 8.0f;
+	float center = noise_2D(x, y);
+	
+	return center + sides + corners;
+}
+
+float interpolated_noise(float x, float y)
+{
+	int x_ = floor_i(x);
+	int y_ = floor_i(y);
+	
+	float frac_x = frac(x);
+	float frac_y = frac(y);
+	
+	float v1 = smooth_noise_2D(x_, y_);
+	float v2 = smooth_noise_2D(x_ + 1, y_);
+	float v3 = smooth_noise_2D(x_, y_ + 1);
+	float v4 = smooth_noise_2D(x_ + 1, y_ + 1);
+	
+	float i1 = cos_interp(v1, v2, frac_x);
+	float i2 = cos_interp(v3, v4, frac_x);
+	
+	return cos_interp(i1, i2, frac_y);
+}
+
+float cos_interp(float a, float b, float t)
+{
+	float theta = t * M_PI;
+	float f = (1.0f - cos(theta)) * 0.5f;
+
+	return (1.0f - f) * a + f * b;
+}
+
+float Perlin2D(float x, float y, float persistence, int n_octave)
+{
+	float total = 0;
+	float p = persistence;
+	
+	int i;
+	for(i = 0; i < n_octave; i++) {
+		
+		float freq = pow(2, i);
+		float ampl = pow(p, i);
+		
+		total += interpolated_noise(x * freq, y * freq) * ampl;
+	}
+	
+	return total;
+}
@@ -0,0 +1,10 @@
+#ifndef NOISE_H
+#define NOISE_H
+
+float noise_2D(int x, int y);
+float smooth_noise_2D(int x, int y);
+float interpolated_noise(float x, float y);
+float cos_interp(float a, float b, float t);
+float Perlin2D(float x, float y, float persistence, int n_octave);
+
+#endif //NOISE_H
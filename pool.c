@@ -0,0 +1,361 @@
+#include "pool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+// Each participating thread owns a queue holding a contiguous range of chunk
+// indices, packed as (end << 32) | begin so both ends move with a single CAS.
+// The owner takes chunks from the front one at a time; a thread whose queue
+// runs dry steals the back half of someone else's range.
+typedef struct {
+	_Atomic uint64_t range;
+	char pad[64 - sizeof(uint64_t)];
+} PoolQueue;
+
+typedef struct {
+	PoolRangeFn fn;
+	void* ctx;
+	int begin;
+	int end;
+	int grain;
+	PoolQueue* queues;
+	int n_queues;
+	atomic_bool cancelled;
+} PoolJob;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t idle;
+	pthread_mutex_t submit;
+	pthread_t* threads;
+	int n_workers;
+	PoolJob* job;
+	unsigned generation;
+	int busy;
+	bool stopping;
+	atomic_bool initialized;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+	.submit = PTHREAD_MUTEX_INITIALIZER
+};
+
+static _Thread_local int thread_index = 0;
+static _Thread_local bool in_job = false;
+
+static uint64_t pack_range(uint32_t begin, uint32_t end)
+{
+	return ((uint64_t)end << 32) | begin;
+}
+
+static bool queue_pop(PoolQueue* q, uint32_t* chunk)
+{
+	uint64_t r = atomic_load(&q->range);
+	
+	for(;;) {
+		uint32_t begin = (uint32_t)r;
+		uint32_t end = (uint32_t)(r >> 32);
+		
+		if(begin >= end) {
+			return false;
+		}
+		
+		if(atomic_compare_exchange_weak(&q->range, &r, pack_range(begin + 1, end))) {
+			*chunk = begin;
+			return true;
+		}
+	}
+}
+
+static bool queue_steal(PoolQueue* q, uint32_t* first, uint32_t* last)
+{
+	uint64_t r = atomic_load(&q->range);
+	
+	for(;;) {
+		uint32_t begin = (uint32_t)r;
+		uint32_t end = (uint32_t)(r >> 32);
+		
+		if(begin >= end) {
+			return false;
+		}
+		
+		uint32_t split = end - ((end - begin + 1) / 2);
+		
+		if(atomic_compare_exchange_weak(&q->range, &r, pack_range(begin, split))) {
+			*first = split;
+			*last = end;
+			return true;
+		}
+	}
+}
+
+static void run_chunk(PoolJob* job, uint32_t chunk)
+{
+	int begin = job->begin + (int)chunk * job->grain;
+	int end = min(begin + job->grain, job->end);
+	
+	if(!job->fn(begin, end, job->ctx)) {
+		atomic_store(&job->cancelled, true);
+	}
+}
+
+static void run_job(PoolJob* job, int self)
+{
+	PoolQueue* own = &job->queues[self];
+	
+	while(!atomic_load(&job->cancelled)) {
+		uint32_t chunk;
+		
+		if(queue_pop(own, &chunk)) {
+			run_chunk(job, chunk);
+			continue;
+		}
+		
+		// Our own range is empty, and nobody else pushes to it, so a plain
+		// store of the stolen remainder is safe.
+		bool stole = false;
+		
+		int i;
+		for(i = 1; i < job->n_queues && !stole; i++) {
+			uint32_t first, last;
+			
+			if(queue_steal(&job->queues[(self + i) % job->n_queues], &first, &last)) {
+				atomic_store(&own->range, pack_range(first + 1, last));
+				run_chunk(job, first);
+				stole = true;
+			}
+		}
+		
+		if(!stole) {
+			break;
+		}
+	}
+}
+
+static void* worker_main(void* arg)
+{
+	thread_index = (int)(intptr_t)arg;
+	in_job = true;
+	
+	unsigned seen = 0;
+	
+	pthread_mutex_lock(&pool.lock);
+	
+	for(;;) {
+		while(!pool.stopping && (!pool.job || pool.generation == seen)) {
+			pthread_cond_wait(&pool.wake, &pool.lock);
+		}
+		
+		if(pool.stopping) {
+			break;
+		}
+		
+		PoolJob* job = pool.job;
+		seen = pool.generation;
+		pool.busy++;
+		pthread_mutex_unlock(&pool.lock);
+		
+		run_job(job, thread_index);
+		
+		pthread_mutex_lock(&pool.lock);
+		pool.busy--;
+		
+		if(pool.busy == 0) {
+			pthread_cond_broadcast(&pool.idle);
+		}
+	}
+	
+	pthread_mutex_unlock(&pool.lock);
+	
+	return NULL;
+}
+
+static void pool_init_locked(int n_workers)
+{
+	if(n_workers < 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n_workers = (cpus > 1) ? (int)(cpus - 1) : 0;
+	}
+	
+	pool.threads = NULL;
+	pool.n_workers = 0;
+	pool.stopping = false;
+	
+	int created = 0;
+	
+	if(n_workers > 0) {
+		pool.threads = malloc(sizeof(pthread_t) * n_workers);
+		
+		if(!pool.threads) {
+			fprintf(stderr, "Error: failed to allocate thread pool.\n");
+			exit(EXIT_FAILURE);
+		}
+		
+		for(; created < n_workers; created++) {
+			if(pthread_create(&pool.threads[created], NULL, worker_main, (void*)(intptr_t)(created + 1)) != 0) {
+				fprintf(stderr, "Warning: created only %d of %d pool workers.\n", created, n_workers);
+				break;
+			}
+		}
+	}
+	
+	// Published only once complete: anyone who sees initialized set also
+	// sees the final worker count.
+	pool.n_workers = created;
+	atomic_store_explicit(&pool.initialized, true, memory_order_release);
+}
+
+void pool_init(int n_workers)
+{
+	// Checked before taking the submit lock, which a running parallel call
+	// holds while its work functions ask for pool_thread_count().
+	if(atomic_load_explicit(&pool.initialized, memory_order_acquire)) {
+		return;
+	}
+	
+	pthread_mutex_lock(&pool.submit);
+	
+	if(!pool.initialized) {
+		pool_init_locked(n_workers);
+	}
+	
+	pthread_mutex_unlock(&pool.submit);
+}
+
+void pool_shutdown(void)
+{
+	pthread_mutex_lock(&pool.submit);
+	
+	if(pool.initialized) {
+		pthread_mutex_lock(&pool.lock);
+		pool.stopping = true;
+		pthread_cond_broadcast(&pool.wake);
+		pthread_mutex_unlock(&pool.lock);
+		
+		int i;
+		for(i = 0; i < pool.n_workers; i++) {
+			pthread_join(pool.threads[i], NULL);
+		}
+		
+		free(pool.threads);
+		pool.threads = NULL;
+		pool.n_workers = 0;
+		atomic_store(&pool.initialized, false);
+	}
+	
+	pthread_mutex_unlock(&pool.submit);
+}
+
+int pool_thread_count(void)
+{
+	pool_init(-1);
+	
+	return pool.n_workers + 1;
+}
+
+int pool_thread_index(void)
+{
+	return thread_index;
+}
+
+static bool run_inline(int begin, int end, int grain, PoolRangeFn fn, void* ctx)
+{
+	int i;
+	for(i = begin; i < end; i += grain) {
+		if(!fn(i, min(i + grain, end), ctx)) {
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+bool parallel_for(int begin, int end, int grain, PoolRangeFn fn, void* ctx)
+{
+	if(end <= begin) {
+		return true;
+	}
+	
+	if(grain <= 0) {
+		grain = 1;
+	}
+	
+	int n_chunks = ((end - begin) + grain - 1) / grain;
+	
+	if(n_chunks == 1 || in_job) {
+		return run_inline(begin, end, grain, fn, ctx);
+	}
+	
+	pool_init(-1);
+	
+	if(pool.n_workers == 0 || pthread_mutex_trylock(&pool.submit) != 0) {
+		return run_inline(begin, end, grain, fn, ctx);
+	}
+	
+	int n_queues = pool.n_workers + 1;
+	PoolQueue* queues = malloc(sizeof(PoolQueue) * n_queues);
+	
+	if(!queues) {
+		pthread_mutex_unlock(&pool.submit);
+		return run_inline(begin, end, grain, fn, ctx);
+	}
+	
+	int i;
+	for(i = 0; i < n_queues; i++) {
+		uint32_t first = (uint32_t)(((int64_t)n_chunks * i) / n_queues);
+		uint32_t last = (uint32_t)(((int64_t)n_chunks * (i + 1)) / n_queues);
+		atomic_init(&queues[i].range, pack_range(first, last));
+	}
+	
+	PoolJob job = { fn, ctx, begin, end, grain, queues, n_queues, false };
+	
+	pthread_mutex_lock(&pool.lock);
+	pool.job = &job;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+	
+	in_job = true;
+	run_job(&job, 0);
+	in_job = false;
+	
+	pthread_mutex_lock(&pool.lock);
+	pool.job = NULL;
+	
+	while(pool.busy > 0) {
+		pthread_cond_wait(&pool.idle, &pool.lock);
+	}
+	
+	pthread_mutex_unlock(&pool.lock);
+	pthread_mutex_unlock(&pool.submit);
+	
+	free(queues);
+	
+	return !atomic_load(&job.cancelled);
+}
+
+typedef struct {
+	PPM_Image* image;
+	PoolRowFn fn;
+	void* ctx;
+} RowJob;
+
+static bool row_chunk(int begin, int end, void* ctx)
+{
+	RowJob* rows = ctx;
+	
+	return rows->fn(rows->image, begin, end, rows->ctx);
+}
+
+bool parallel_for_rows(PPM_Image* image, int grain, PoolRowFn fn, void* ctx)
+{
+	if(grain <= 0) {
+		grain = max(1, image->header.height / (pool_thread_count() * 4));
+	}
+	
+	RowJob rows = { image, fn, ctx };
+	
+	return parallel_for(0, image->header.height, grain, row_chunk, &rows);
+}
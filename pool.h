@@ -0,0 +1,37 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "ppm.h"
+#include <stdbool.h>
+
+// Library-wide work-stealing thread pool. The pool is created once, either
+// explicitly with pool_init() at startup or lazily by the first parallel call,
+// and every image operation shares it.
+//
+// Work functions return true to keep going; returning false cancels every
+// chunk that has not started yet, and the parallel call then returns false.
+// Calls made from inside a work function (or while another thread is already
+// using the pool) run inline on the calling thread.
+
+typedef bool (*PoolRangeFn)(int begin, int end, void* ctx);
+typedef bool (*PoolRowFn)(PPM_Image* image, int y_begin, int y_end, void* ctx);
+
+// n_workers < 0 picks one worker per online CPU besides the calling thread;
+// n_workers == 0 runs everything on the calling thread.
+void pool_init(int n_workers);
+void pool_shutdown(void);
+
+// Number of threads that take part in a parallel call, including the caller.
+int pool_thread_count(void);
+
+// 1..n on pool workers, 0 on every other thread. Useful for indexing
+// per-thread scratch state sized with pool_thread_count().
+int pool_thread_index(void);
+
+bool parallel_for(int begin, int end, int grain, PoolRangeFn fn, void* ctx);
+
+// Splits the image's rows into chunks of grain rows (grain <= 0 picks a size
+// from the image height and thread count) and runs fn over them in parallel.
+bool parallel_for_rows(PPM_Image* image, int grain, PoolRowFn fn, void* ctx);
+
+#endif //POOL_H
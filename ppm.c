@@ -1,4 +1,21 @@
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
 #include "ppm.h"
+#include "pool.h"
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define PPM_SSE2 1
+#endif
 
 int min(int l, int r)
 {
@@ -25,6 +42,11 @@ PPM_Pixel ppm_rgb(int r, int g, int b)
 }
 
 PPM_Image* ppm_create(int w, int h)
+{
+	return ppm_create_layout(w, h, PPM_LAYOUT_LINEAR);
+}
+
+PPM_Image* ppm_create_layout(int w, int h, PPM_Layout layout)
 {
 	PPM_Image* img;
 	
@@ -37,7 +59,26 @@ PPM_Image* ppm_create(int w, int h)
 	
 	img->header.width = w;
 	img->header.height = h;
-	img->buffer = malloc(sizeof(PPM_Pixel) * img->header.width * img->header.height);
+	img->depth = NULL;
+	img->layout = layout;
+	img->blend_space = PPM_BLEND_SRGB;
+	img->blend_mode = PPM_BLEND_NORMAL;
+	img->tiles_x = (w + PPM_TILE_MASK) >> PPM_TILE_SHIFT;
+	img->map = NULL;
+	img->map_size = 0;
+	img->map_path = NULL;
+	img->map_dev = 0;
+	img->map_ino = 0;
+	
+	// Tiled images are padded out to whole tiles.
+	size_t n_pixels = (size_t)w * h;
+	
+	if(layout == PPM_LAYOUT_TILED) {
+		size_t tiles_y = (size_t)(h + PPM_TILE_MASK) >> PPM_TILE_SHIFT;
+		n_pixels = (size_t)img->tiles_x * tiles_y * PPM_TILE_SIZE * PPM_TILE_SIZE;
+	}
+	
+	img->buffer = malloc(sizeof(PPM_Pixel) * n_pixels);
 	
 	if(!img->buffer) {
 		fprintf(stderr, "Error: failed to allocate PPM image buffer.\n");
@@ -45,19 +86,131 @@ PPM_Image* ppm_create(int w, int h)
 		exit(EXIT_FAILURE);
 	}
 	
-	int i;
-	for(i = 0; i < img->header.width * img->header.height; i++) {
+	size_t i;
+	for(i = 0; i < n_pixels; i++) {
 		img->buffer[i] = (PPM_Pixel) {0, 0, 0};
 	}
 	
 	return img;
 }
 
+PPM_Image* ppm_create_mapped(const char* path, int w, int h)
+{
+	if(w <= 0 || h <= 0) {
+		fprintf(stderr, "Error: invalid mapped image size %d x %d.\n", w, h);
+		return NULL;
+	}
+	
+	char header[64];
+	size_t header_len = (size_t)snprintf(header, sizeof(header), "P6\n%d %d\n255\n", w, h);
+	
+	if((size_t)w * h > (SIZE_MAX - header_len) / sizeof(PPM_Pixel)) {
+		fprintf(stderr, "Error: mapped image %d x %d is too large to address.\n", w, h);
+		return NULL;
+	}
+	
+	size_t map_size = header_len + (sizeof(PPM_Pixel) * (size_t)w * h);
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	
+	if(fd < 0) {
+		fprintf(stderr, "Error opening mapped image file %s.\n", path);
+		return NULL;
+	}
+	
+	// The file is sized without writing it, so its pixels start out as
+	// unallocated zero (black) pages.
+	if(ftruncate(fd, (off_t)map_size) != 0) {
+		fprintf(stderr, "Error: failed to size mapped image file %s.\n", path);
+		close(fd);
+		return NULL;
+	}
+	
+	struct stat st;
+	
+	if(fstat(fd, &st) != 0) {
+		fprintf(stderr, "Error: failed to stat mapped image file %s.\n", path);
+		close(fd);
+		return NULL;
+	}
+	
+	void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	
+	if(map == MAP_FAILED) {
+		fprintf(stderr, "Error: failed to map image file %s.\n", path);
+		return NULL;
+	}
+	
+	PPM_Image* img = malloc(sizeof(PPM_Image));
+	char* map_path = malloc(strlen(path) + 1);
+	
+	if(!img || !map_path) {
+		fprintf(stderr, "Error: failed to allocate PPM image.\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	memcpy(map, header, header_len);
+	strcpy(map_path, path);
+	
+	img->header.width = w;
+	img->header.height = h;
+	img->buffer = (PPM_Pixel*)((char*)map + header_len);
+	img->depth = NULL;
+	img->layout = PPM_LAYOUT_LINEAR;
+	img->blend_space = PPM_BLEND_SRGB;
+	img->blend_mode = PPM_BLEND_NORMAL;
+	img->tiles_x = (w + PPM_TILE_MASK) >> PPM_TILE_SHIFT;
+	img->map = map;
+	img->map_size = map_size;
+	img->map_path = map_path;
+	img->map_dev = (uint64_t)st.st_dev;
+	img->map_ino = (uint64_t)st.st_ino;
+	
+	return img;
+}
+
+void ppm_sync(PPM_Image* img)
+{
+	if(img->map && msync(img->map, img->map_size, MS_SYNC) != 0) {
+		fprintf(stderr, "Error: failed to sync mapped image %s.\n", img->map_path);
+	}
+}
+
+void ppm_advise(PPM_Image* img, PPM_Access access)
+{
+	if(!img->map) {
+		return;
+	}
+	
+	int advice = POSIX_MADV_NORMAL;
+	
+	if(access == PPM_ACCESS_SEQUENTIAL) {
+		advice = POSIX_MADV_SEQUENTIAL;
+	} else if(access == PPM_ACCESS_RANDOM) {
+		advice = POSIX_MADV_RANDOM;
+	}
+	
+	posix_madvise(img->map, img->map_size, advice);
+}
+
 void ppm_destroy(PPM_Image* img)
 {
 	if(img) {
-		free(img->buffer);
+		if(img->map) {
+			munmap(img->map, img->map_size);
+			free(img->map_path);
+			img->map = NULL;
+		} else {
+			free(img->buffer);
+		}
 		img->buffer = NULL;
+		
+		if(img->depth) {
+			free(img->depth->values);
+			free(img->depth->tile_max);
+			free(img->depth);
+			img->depth = NULL;
+		}
 	}
 	free(img);
 }
@@ -65,7 +218,7 @@ void ppm_destroy(PPM_Image* img)
 void ppm_set_pixel(PPM_Image* img, int x, int y, PPM_Pixel pixel)
 {
 	if(y < img->header.height && x < img->header.width && y >= 0 && x >= 0) {
-		img->buffer[(y * img->header.width) + x] = pixel;
+		img->buffer[ppm_index(img, x, y)] = pixel;
 	}
 }
 
@@ -96,11 +249,195 @@ PPM_Pixel ppm_get_pixel(const PPM_Image* img, int x, int y)
 		return ppm_rgb(0, 0, 0);
 	}
 
-	return img->buffer[(y * img->header.width) + x];
+	return img->buffer[ppm_index(img, x, y)];
+}
+
+void ppm_read_row(const PPM_Image* img, int y, PPM_Pixel* out)
+{
+	int x = 0;
+	
+	while(x < img->header.width) {
+		int run;
+		const PPM_Pixel* src = ppm_run(img, x, y, &run);
+		run = min(run, img->header.width - x);
+		memcpy(out + x, src, sizeof(PPM_Pixel) * run);
+		x += run;
+	}
+}
+
+void ppm_write_row(PPM_Image* img, int y, const PPM_Pixel* in)
+{
+	int x = 0;
+	
+	while(x < img->header.width) {
+		int run;
+		PPM_Pixel* dst = ppm_run(img, x, y, &run);
+		run = min(run, img->header.width - x);
+		memcpy(dst, in + x, sizeof(PPM_Pixel) * run);
+		x += run;
+	}
+}
+
+static uint8_t grey_value(PPM_Pixel p)
+{
+	return (uint8_t)((77 * p.r + 150 * p.g + 29 * p.b) >> 8);
+}
+
+// Decimal text for 0..255 with a trailing space, so the ASCII writers can
+// emit a sample with one 4-byte copy instead of going through fprintf.
+static char ascii_digits[256][4];
+static uint8_t ascii_lengths[256];
+
+static void init_ascii_digits(void)
+{
+	static int init = 0;
+	
+	if(init) {
+		return;
+	}
+	
+	int i;
+	for(i = 0; i < 256; i++) {
+		char tmp[8];
+		int len = snprintf(tmp, sizeof(tmp), "%d ", i);
+		memcpy(ascii_digits[i], tmp, 4);
+		ascii_lengths[i] = (uint8_t)len;
+	}
+	init = 1;
+}
+
+// Formats one row of samples, wrapping lines so none exceed the 70 characters
+// the plain formats allow. Returns the number of bytes written to out, which
+// must hold at least ascii_row_capacity() bytes.
+static size_t format_ascii_row(const PPM_Pixel* row, int width, bool grey, char* out)
+{
+	char* p = out;
+	int col = 0;
+	
+	int i;
+	for(i = 0; i < width; i++) {
+		uint8_t samples[3];
+		int n_samples;
+		
+		if(grey) {
+			samples[0] = grey_value(row[i]);
+			n_samples = 1;
+		} else {
+			samples[0] = row[i].r;
+			samples[1] = row[i].g;
+			samples[2] = row[i].b;
+			n_samples = 3;
+		}
+		
+		int s;
+		for(s = 0; s < n_samples; s++) {
+			if(col + 4 > 70) {
+				p[-1] = '\n';
+				col = 0;
+			}
+			
+			memcpy(p, ascii_digits[samples[s]], 4);
+			p += ascii_lengths[samples[s]];
+			col += ascii_lengths[samples[s]];
+		}
+	}
+	
+	if(p != out) {
+		p[-1] = '\n';
+	}
+	
+	return (size_t)(p - out);
+}
+
+static size_t ascii_row_capacity(int width)
+{
+	return (size_t)width * 3 * 4 + 1;
+}
+
+typedef struct {
+	const PPM_Image* img;
+	PPM_Format format;
+	size_t capacity;
+	int first_row;
+	uint8_t* rows;
+	size_t* lengths;
+	PPM_Pixel* linear;
+} RowEncoder;
+
+static bool encode_rows(int begin, int end, void* ctx)
+{
+	RowEncoder* enc = ctx;
+	int width = enc->img->header.width;
+	
+	int i, k;
+	for(k = begin; k < end; k++) {
+		const PPM_Pixel* src = &enc->img->buffer[ppm_index(enc->img, 0, enc->first_row + k)];
+		
+		if(enc->img->layout != PPM_LAYOUT_LINEAR) {
+			PPM_Pixel* linear = enc->linear + ((size_t)width * k);
+			ppm_read_row(enc->img, enc->first_row + k, linear);
+			src = linear;
+		}
+		
+		uint8_t* row = enc->rows + (enc->capacity * k);
+		size_t len = 0;
+		
+		switch(enc->format) {
+			case PPM_FORMAT_P2:
+				len = format_ascii_row(src, width, true, (char*)row);
+				break;
+			case PPM_FORMAT_P3:
+				len = format_ascii_row(src, width, false, (char*)row);
+				break;
+			case PPM_FORMAT_P5:
+				for(i = 0; i < width; i++) {
+					row[i] = grey_value(src[i]);
+				}
+				len = (size_t)width;
+				break;
+			case PPM_FORMAT_P6:
+				memcpy(row, src, sizeof(PPM_Pixel) * width);
+				len = (size_t)width * 3;
+				break;
+			default:
+				for(i = 0; i < width; i++) {
+					row[(i * 6) + 0] = src[i].r;
+					row[(i * 6) + 1] = src[i].r;
+					row[(i * 6) + 2] = src[i].g;
+					row[(i * 6) + 3] = src[i].g;
+					row[(i * 6) + 4] = src[i].b;
+					row[(i * 6) + 5] = src[i].b;
+				}
+				len = (size_t)width * 6;
+				break;
+		}
+		
+		enc->lengths[k] = len;
+	}
+	
+	return true;
 }
 
 void ppm_save(PPM_Image* img, const char* filename)
 {
+	ppm_save_format(img, filename, PPM_FORMAT_P6);
+}
+
+void ppm_save_format(PPM_Image* img, const char* filename, PPM_Format format)
+{
+	// A mapped image already is its P6 file, whatever path names it.
+	// Reopening that file for writing would truncate pages still mapped.
+	struct stat st;
+	
+	if(img->map && stat(filename, &st) == 0 && (uint64_t)st.st_dev == img->map_dev && (uint64_t)st.st_ino == img->map_ino) {
+		if(format == PPM_FORMAT_P6) {
+			ppm_sync(img);
+		} else {
+			fprintf(stderr, "Error: can't save mapped image %s over its own file in another format.\n", img->map_path);
+		}
+		return;
+	}
+	
 	FILE* out;
 	out = fopen(filename, "wb");
 	
@@ -109,19 +446,438 @@ void ppm_save(PPM_Image* img, const char* filename)
 		exit(EXIT_FAILURE);
 	}
 	
-	fprintf(out, "P6\n%d %d\n255\n", img->header.width, img->header.height);
+	int width = img->header.width;
+	int height = img->header.height;
+	
+	switch(format) {
+		case PPM_FORMAT_P2: fprintf(out, "P2\n%d %d\n255\n", width, height); break;
+		case PPM_FORMAT_P3: fprintf(out, "P3\n%d %d\n255\n", width, height); break;
+		case PPM_FORMAT_P5: fprintf(out, "P5\n%d %d\n255\n", width, height); break;
+		case PPM_FORMAT_P6: fprintf(out, "P6\n%d %d\n255\n", width, height); break;
+		case PPM_FORMAT_P6_16: fprintf(out, "P6\n%d %d\n65535\n", width, height); break;
+	}
+	
+	if(format == PPM_FORMAT_P6 && img->layout == PPM_LAYOUT_LINEAR) {
+		int j;
+		for(j = 0; j < height; j++) {
+			fwrite(&img->buffer[ppm_index(img, 0, j)], sizeof(PPM_Pixel), width, out);
+		}
+		
+		fflush(out);
+		fclose(out);
+		return;
+	}
+	
+	size_t capacity = 0;
+	
+	switch(format) {
+		case PPM_FORMAT_P2:
+		case PPM_FORMAT_P3: capacity = ascii_row_capacity(width); break;
+		case PPM_FORMAT_P5: capacity = (size_t)width; break;
+		case PPM_FORMAT_P6: capacity = (size_t)width * 3; break;
+		default: capacity = (size_t)width * 6; break;
+	}
+	
+	// Rows are encoded a batch at a time on the thread pool and then written
+	// in order from the calling thread.
+	int batch = pool_thread_count() * 4;
+	RowEncoder enc = { img, format, capacity, 0, NULL, NULL, NULL };
+	enc.rows = malloc(capacity * batch);
+	enc.lengths = malloc(sizeof(size_t) * batch);
+	
+	// Tiled images are linearised a row at a time on the way out.
+	if(img->layout != PPM_LAYOUT_LINEAR) {
+		enc.linear = malloc(sizeof(PPM_Pixel) * width * batch);
+	}
+	
+	if(!enc.rows || !enc.lengths || (img->layout != PPM_LAYOUT_LINEAR && !enc.linear)) {
+		fprintf(stderr, "Error: failed to allocate PPM row buffer.\n");
+		free(enc.rows);
+		free(enc.lengths);
+		free(enc.linear);
+		fclose(out);
+		exit(EXIT_FAILURE);
+	}
+	
+	init_ascii_digits();
 	
-	int i, j;
-	for(j = 0; j < img->header.height; j++) {
-		for(i = 0; i < img->header.width; i++) {
-			uint8_t* buf = (uint8_t*)(&img->buffer[(j * img->header.width) + i]);
-			fwrite(buf, 1, 3, out);
+	int j;
+	for(j = 0; j < height; j += batch) {
+		int n = min(batch, height - j);
+		enc.first_row = j;
+		parallel_for(0, n, 1, encode_rows, &enc);
+		
+		int k;
+		for(k = 0; k < n; k++) {
+			fwrite(enc.rows + (capacity * k), 1, enc.lengths[k], out);
 		}
 	}
+	
+	free(enc.rows);
+	free(enc.lengths);
+	free(enc.linear);
 	fflush(out);
 	fclose(out);
 }
 
+// Reads the whole file into memory with a few bytes of zero padding after the
+// end, so the sample parsers can load 4 bytes at a time without bounds checks.
+static uint8_t* read_file(FILE* in, size_t* size)
+{
+	if(fseek(in, 0, SEEK_END) != 0) {
+		return NULL;
+	}
+	
+	long len = ftell(in);
+	
+	if(len < 0 || fseek(in, 0, SEEK_SET) != 0) {
+		return NULL;
+	}
+	
+	uint8_t* data = malloc((size_t)len + 8);
+	
+	if(!data) {
+		return NULL;
+	}
+	
+	if(fread(data, 1, (size_t)len, in) != (size_t)len) {
+		free(data);
+		return NULL;
+	}
+	
+	memset(data + len, 0, 8);
+	*size = (size_t)len;
+	
+	return data;
+}
+
+static bool is_space(uint8_t c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static bool is_digit(uint8_t c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static const uint8_t* skip_header_space(const uint8_t* p, const uint8_t* end)
+{
+	while(p < end) {
+		if(*p == '#') {
+			while(p < end && *p != '\n' && *p != '\r') {
+				p++;
+			}
+		} else if(is_space(*p)) {
+			p++;
+		} else {
+			break;
+		}
+	}
+	
+	return p;
+}
+
+static const uint8_t* parse_header_uint(const uint8_t* p, const uint8_t* end, unsigned* out)
+{
+	p = skip_header_space(p, end);
+	
+	if(p >= end || !is_digit(*p)) {
+		return NULL;
+	}
+	
+	unsigned long value = 0;
+	while(p < end && is_digit(*p)) {
+		value = (value * 10) + (*p - '0');
+		
+		if(value > INT_MAX) {
+			return NULL;
+		}
+		p++;
+	}
+	
+	*out = (unsigned)value;
+	return p;
+}
+
+#ifdef PPM_SSE2
+// Parses the samples in the 16 bytes at p, which must start with a digit.
+// Digits and whitespace are classified for the whole block at once, and the
+// value of every digit run of up to three digits is accumulated in 16-bit
+// lanes as d[i] + 10 * d[i - 1] + 100 * d[i - 2], so each sample is just read
+// from the lane of its last digit. Stops at the first run that is longer,
+// isn't closed by whitespace inside the block, or is followed by anything
+// else, leaving those to the scalar loop. *consumed is set past the last
+// sample parsed and any whitespace after it.
+static size_t parse_ascii_block(const uint8_t* p, uint16_t* out, size_t count, size_t* consumed)
+{
+	__m128i c = _mm_loadu_si128((const __m128i*)p);
+	__m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	__m128i w = _mm_sub_epi8(c, _mm_set1_epi8('\t'));
+	__m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+	__m128i is_space = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(w, _mm_set1_epi8('\r' - '\t')), w), _mm_cmpeq_epi8(c, _mm_set1_epi8(' ')));
+	
+	unsigned digits = (unsigned)_mm_movemask_epi8(is_digit);
+	unsigned spaces = (unsigned)_mm_movemask_epi8(is_space);
+	unsigned other = ~(digits | spaces) & 0xFFFF;
+	
+	if(other) {
+		unsigned keep = (1u << __builtin_ctz(other)) - 1;
+		digits &= keep;
+		spaces &= keep;
+	}
+	
+	__m128i d0 = _mm_and_si128(d, is_digit);
+	__m128i d1 = _mm_slli_si128(d0, 1);
+	__m128i d2 = _mm_and_si128(_mm_slli_si128(d0, 2), _mm_slli_si128(is_digit, 1));
+	__m128i zero = _mm_setzero_si128();
+	__m128i ten = _mm_set1_epi16(10);
+	__m128i hundred = _mm_set1_epi16(100);
+	
+	uint16_t values[16];
+	_mm_storeu_si128((__m128i*)values, _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(d0, zero),
+		_mm_mullo_epi16(_mm_unpacklo_epi8(d1, zero), ten)), _mm_mullo_epi16(_mm_unpacklo_epi8(d2, zero), hundred)));
+	_mm_storeu_si128((__m128i*)(values + 8), _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(d0, zero),
+		_mm_mullo_epi16(_mm_unpackhi_epi8(d1, zero), ten)), _mm_mullo_epi16(_mm_unpackhi_epi8(d2, zero), hundred)));
+	
+	unsigned starts = digits & ~(digits << 1);
+	unsigned ends = spaces & (digits << 1);
+	size_t n = 0;
+	unsigned pos = 0;
+	
+	while(starts && n < count) {
+		unsigned start = __builtin_ctz(starts);
+		unsigned after = ends & ~((1u << start) - 1);
+		
+		if(!after) {
+			break;
+		}
+		
+		unsigned stop = __builtin_ctz(after);
+		
+		if(stop - start > 3) {
+			break;
+		}
+		
+		out[n++] = values[stop - 1];
+		starts &= starts - 1;
+		pos = starts ? (unsigned)__builtin_ctz(starts) : stop;
+	}
+	
+	*consumed = pos;
+	return n;
+}
+#endif
+
+// Parses up to count whitespace separated decimal samples from [p, end). The
+// buffer must be readable for 4 bytes past end (see read_file). Returns the
+// number of samples parsed; fewer than count means the data ran out or
+// contained something other than digits and whitespace.
+static size_t parse_ascii_samples(const uint8_t* p, const uint8_t* end, uint16_t* out, size_t count)
+{
+	size_t n = 0;
+	
+	while(n < count) {
+		while(p < end && is_space(*p)) {
+			p++;
+		}
+		
+		if(p >= end || !is_digit(*p)) {
+			break;
+		}
+		
+#ifdef PPM_SSE2
+		if(end - p >= 16) {
+			size_t consumed;
+			size_t parsed = parse_ascii_block(p, out + n, count - n, &consumed);
+			
+			if(parsed) {
+				n += parsed;
+				p += consumed;
+				continue;
+			}
+		}
+#endif
+		
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		// SWAR path: classify four bytes at once and convert up to three
+		// digits with two multiplies, which covers every sample of a
+		// maxval <= 255 file.
+		uint32_t chunk;
+		memcpy(&chunk, p, 4);
+		
+		uint32_t nibbles = ((chunk & 0xF0F0F0F0u) ^ 0x30303030u) |
+			(((chunk + 0x06060606u) & 0xF0F0F0F0u) ^ 0x30303030u);
+		uint32_t non_digit = (((nibbles & 0x7F7F7F7Fu) + 0x7F7F7F7Fu) | nibbles) & 0x80808080u;
+		
+		if(non_digit) {
+			int len = __builtin_ctz(non_digit) >> 3;
+			
+			if(len < 4 && p + len <= end) {
+				uint32_t digits = (chunk - 0x30303030u) << (8 * (4 - len));
+				digits = (digits * 10) + (digits >> 8);
+				out[n++] = (uint16_t)(((digits & 0xFF) * 100) + ((digits >> 16) & 0xFF));
+				p += len;
+				continue;
+			}
+		}
+#endif
+		
+		unsigned value = 0;
+		while(p < end && is_digit(*p)) {
+			value = (value * 10) + (*p - '0');
+			
+			if(value > 65535) {
+				return n;
+			}
+			p++;
+		}
+		
+		out[n++] = (uint16_t)value;
+	}
+	
+	return n;
+}
+
+// Large ASCII rasters are cut into chunks at whitespace, the samples in each
+// chunk are counted in parallel, and a prefix sum over the counts tells every
+// chunk where its samples land so the chunks can then be parsed in parallel.
+#define ASCII_CHUNK_BYTES (1 << 20)
+
+typedef struct {
+	const uint8_t** bounds;
+	size_t* offsets;
+	uint16_t* samples;
+	size_t n_samples;
+	atomic_bool failed;
+} AsciiChunks;
+
+static bool count_chunk_samples(int begin, int end, void* ctx)
+{
+	AsciiChunks* chunks = ctx;
+	
+	int c;
+	for(c = begin; c < end; c++) {
+		const uint8_t* p = chunks->bounds[c];
+		const uint8_t* stop = chunks->bounds[c + 1];
+		size_t count = 0;
+		bool prev_digit = false;
+		
+#ifdef PPM_SSE2
+		// A sample starts at every digit that doesn't follow another, so
+		// count those 16 bytes at a time, carrying the last byte's digit
+		// state into the next block.
+		unsigned carry = 0;
+		
+		for(; stop - p >= 16; p += 16) {
+			__m128i d = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)p), _mm_set1_epi8('0'));
+			unsigned digits = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d));
+			
+			count += (size_t)__builtin_popcount(digits & ~((digits << 1) | carry));
+			carry = digits >> 15;
+		}
+		
+		prev_digit = carry;
+#endif
+		
+		for(; p < stop; p++) {
+			bool digit = is_digit(*p);
+			count += (digit && !prev_digit);
+			prev_digit = digit;
+		}
+		
+		chunks->offsets[c + 1] = count;
+	}
+	
+	return true;
+}
+
+static bool parse_chunk_samples(int begin, int end, void* ctx)
+{
+	AsciiChunks* chunks = ctx;
+	
+	int c;
+	for(c = begin; c < end; c++) {
+		size_t offset = chunks->offsets[c];
+		
+		if(offset >= chunks->n_samples) {
+			continue;
+		}
+		
+		size_t count = chunks->offsets[c + 1] - offset;
+		
+		if(offset + count > chunks->n_samples) {
+			count = chunks->n_samples - offset;
+		}
+		
+		if(parse_ascii_samples(chunks->bounds[c], chunks->bounds[c + 1], chunks->samples + offset, count) != count) {
+			atomic_store(&chunks->failed, true);
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+static bool parse_ascii_raster(const uint8_t* p, const uint8_t* end, uint16_t* samples, size_t n_samples)
+{
+	size_t n_chunks = ((size_t)(end - p) / ASCII_CHUNK_BYTES) + 1;
+	
+	// The counting pass only pays for itself when the chunks can then be
+	// parsed side by side.
+	if(n_chunks == 1 || pool_thread_count() == 1) {
+		return parse_ascii_samples(p, end, samples, n_samples) == n_samples;
+	}
+	
+	AsciiChunks chunks;
+	chunks.bounds = malloc(sizeof(const uint8_t*) * (n_chunks + 1));
+	chunks.offsets = malloc(sizeof(size_t) * (n_chunks + 1));
+	chunks.samples = samples;
+	chunks.n_samples = n_samples;
+	atomic_init(&chunks.failed, false);
+	
+	if(!chunks.bounds || !chunks.offsets) {
+		free(chunks.bounds);
+		free(chunks.offsets);
+		return parse_ascii_samples(p, end, samples, n_samples) == n_samples;
+	}
+	
+	size_t c;
+	chunks.bounds[0] = p;
+	for(c = 1; c < n_chunks; c++) {
+		const uint8_t* cut = p + (c * ASCII_CHUNK_BYTES);
+		
+		if(cut < chunks.bounds[c - 1]) {
+			cut = chunks.bounds[c - 1];
+		}
+		
+		while(cut < end && !is_space(*cut)) {
+			cut++;
+		}
+		chunks.bounds[c] = cut;
+	}
+	chunks.bounds[n_chunks] = end;
+	
+	parallel_for(0, (int)n_chunks, 1, count_chunk_samples, &chunks);
+	
+	chunks.offsets[0] = 0;
+	for(c = 1; c <= n_chunks; c++) {
+		chunks.offsets[c] += chunks.offsets[c - 1];
+	}
+	
+	bool ok = chunks.offsets[n_chunks] >= n_samples;
+	
+	if(ok) {
+		parallel_for(0, (int)n_chunks, 1, parse_chunk_samples, &chunks);
+		ok = !atomic_load(&chunks.failed);
+	}
+	
+	free(chunks.bounds);
+	free(chunks.offsets);
+	
+	return ok;
+}
+
 PPM_Image* ppm_load(const char* filename)
 {
 	FILE* in;
@@ -132,41 +888,433 @@ PPM_Image* ppm_load(const char* filename)
 		return NULL;
 	}
 	
-	char buf[2];
-	int width, height;
-	int max_val;
+	size_t size;
+	uint8_t* data = read_file(in, &size);
+	fclose(in);
+	
+	if(!data) {
+		fprintf(stderr, "Error reading input file.\n");
+		return NULL;
+	}
 	
-	fread(buf, 1, 2, in);
+	const uint8_t* p = data;
+	const uint8_t* end = data + size;
 	
-	if(buf[0] != 'P' || buf[1] != '6') {
+	if(size < 2 || p[0] != 'P' || (p[1] != '2' && p[1] != '3' && p[1] != '5' && p[1] != '6')) {
 		fprintf(stderr, "Error: unsupported format.\n");
-		exit(EXIT_FAILURE);
+		free(data);
+		return NULL;
 	}
 	
-	while(fscanf(in, "%d %d", &width, &height) != 2);
-	fscanf(in, "%d", &max_val);
+	char kind = (char)p[1];
+	bool ascii = (kind == '2' || kind == '3');
+	int channels = (kind == '3' || kind == '6') ? 3 : 1;
+	p += 2;
 	
-	PPM_Image* img = ppm_create(width, height);
+	unsigned width, height, max_val;
+	p = parse_header_uint(p, end, &width);
+	p = p ? parse_header_uint(p, end, &height) : NULL;
+	p = p ? parse_header_uint(p, end, &max_val) : NULL;
 	
-	int i, j;
-	for(j = 0; j < img->header.height; j++) {
-		for(i = 0; i < img->header.width; i++) {
-			uint8_t components[3];
-			fread(components, 1, 3, in);
-			
-			components[0] = 255 * components[0] / max_val;
-			components[1] = 255 * components[1] / max_val;
-			components[2] = 255 * components[2] / max_val;
-			
-			img->buffer[(j * img->header.width) + i] = (PPM_Pixel) { 
-				components[0], 
-				components[1], 
-				components[2] 
+	if(!p || p >= end || !is_space(*p) || width == 0 || height == 0 || max_val == 0 || max_val > 65535) {
+		fprintf(stderr, "Error: malformed header.\n");
+		free(data);
+		return NULL;
+	}
+	
+	// A single whitespace character separates the header from the raster.
+	p++;
+	
+	// Every ASCII sample takes at least a digit and a separator, except the
+	// last, and every binary one 1 or 2 bytes, so a raster that can't fit in
+	// the file is rejected before allocating for it.
+	size_t min_sample_bytes = (ascii || max_val > 255) ? 2 : 1;
+	
+	if(width > SIZE_MAX / height / channels / sizeof(uint16_t) ||
+		((size_t)width * height * channels * min_sample_bytes) - ascii > (size_t)(end - p)) {
+		fprintf(stderr, "Error: malformed header.\n");
+		free(data);
+		return NULL;
+	}
+	
+	size_t n_pixels = (size_t)width * height;
+	size_t n_samples = n_pixels * channels;
+	
+	// Maps every legal sample value straight to its 8-bit equivalent.
+	uint8_t* scale = malloc((size_t)max_val + 1);
+	uint16_t* samples = malloc(n_samples * sizeof(uint16_t));
+	
+	if(!scale || !samples) {
+		fprintf(stderr, "Error: failed to allocate PPM sample buffer.\n");
+		free(scale);
+		free(samples);
+		free(data);
+		return NULL;
+	}
+	
+	unsigned v;
+	for(v = 0; v <= max_val; v++) {
+		scale[v] = (uint8_t)(((v * 255u) + (max_val / 2)) / max_val);
+	}
+	
+	bool ok = true;
+	
+	if(ascii) {
+		ok = parse_ascii_raster(p, end, samples, n_samples);
+	} else {
+		size_t sample_bytes = (max_val > 255) ? 2 : 1;
+		
+		if((size_t)(end - p) < n_samples * sample_bytes) {
+			ok = false;
+		} else if(sample_bytes == 1) {
+			size_t i;
+			for(i = 0; i < n_samples; i++) {
+				samples[i] = p[i];
+			}
+		} else {
+			size_t i;
+			for(i = 0; i < n_samples; i++) {
+				samples[i] = (uint16_t)((p[i * 2] << 8) | p[(i * 2) + 1]);
+			}
+		}
+	}
+	
+	free(data);
+	
+	if(!ok) {
+		fprintf(stderr, "Error: truncated or malformed pixel data.\n");
+		free(scale);
+		free(samples);
+		return NULL;
+	}
+	
+	PPM_Image* img = ppm_create((int)width, (int)height);
+	
+	size_t i;
+	for(i = 0; i < n_samples; i++) {
+		if(samples[i] > max_val) {
+			samples[i] = (uint16_t)max_val;
+		}
+	}
+	
+	if(channels == 3) {
+		for(i = 0; i < n_pixels; i++) {
+			img->buffer[i] = (PPM_Pixel) {
+				scale[samples[(i * 3) + 0]],
+				scale[samples[(i * 3) + 1]],
+				scale[samples[(i * 3) + 2]]
 			};
 		}
+	} else {
+		for(i = 0; i < n_pixels; i++) {
+			uint8_t grey = scale[samples[i]];
+			img->buffer[i] = (PPM_Pixel) { grey, grey, grey };
+		}
 	}
 	
-	fclose(in);
+	free(scale);
+	free(samples);
 	
 	return img;
 }
+
+// XXH64 over the pixel bytes. Four independent accumulators consume 32 bytes
+// per step, which keeps the multipliers busy without any SIMD intrinsics.
+#define XXH_PRIME1 0x9E3779B185EBCA87ull
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4Full
+#define XXH_PRIME3 0x165667B19E3779F9ull
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ull
+#define XXH_PRIME5 0x27D4EB2F165667C5ull
+
+typedef struct {
+	uint64_t acc[4];
+	uint8_t tail[32];
+	size_t tail_len;
+	uint64_t total;
+	uint64_t seed;
+} HashState;
+
+static uint64_t rotl64(uint64_t v, int r)
+{
+	return (v << r) | (v >> (64 - r));
+}
+
+static uint64_t read64(const uint8_t* p)
+{
+	uint64_t v;
+	memcpy(&v, p, 8);
+	
+	return v;
+}
+
+static uint32_t read32(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	
+	return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t lane)
+{
+	acc += lane * XXH_PRIME2;
+	acc = rotl64(acc, 31);
+	
+	return acc * XXH_PRIME1;
+}
+
+static uint64_t xxh_merge(uint64_t h, uint64_t acc)
+{
+	h ^= xxh_round(0, acc);
+	
+	return (h * XXH_PRIME1) + XXH_PRIME4;
+}
+
+static void hash_init(HashState* state, uint64_t seed)
+{
+	state->acc[0] = seed + XXH_PRIME1 + XXH_PRIME2;
+	state->acc[1] = seed + XXH_PRIME2;
+	state->acc[2] = seed;
+	state->acc[3] = seed - XXH_PRIME1;
+	state->tail_len = 0;
+	state->total = 0;
+	state->seed = seed;
+}
+
+static void hash_stripes(HashState* state, const uint8_t* p, size_t n_stripes)
+{
+	uint64_t a0 = state->acc[0];
+	uint64_t a1 = state->acc[1];
+	uint64_t a2 = state->acc[2];
+	uint64_t a3 = state->acc[3];
+	
+	size_t i;
+	for(i = 0; i < n_stripes; i++, p += 32) {
+		a0 = xxh_round(a0, read64(p));
+		a1 = xxh_round(a1, read64(p + 8));
+		a2 = xxh_round(a2, read64(p + 16));
+		a3 = xxh_round(a3, read64(p + 24));
+	}
+	
+	state->acc[0] = a0;
+	state->acc[1] = a1;
+	state->acc[2] = a2;
+	state->acc[3] = a3;
+}
+
+static void hash_update(HashState* state, const uint8_t* p, size_t len)
+{
+	state->total += len;
+	
+	if(state->tail_len > 0) {
+		size_t fill = 32 - state->tail_len;
+		
+		if(len < fill) {
+			memcpy(state->tail + state->tail_len, p, len);
+			state->tail_len += len;
+			return;
+		}
+		
+		memcpy(state->tail + state->tail_len, p, fill);
+		hash_stripes(state, state->tail, 1);
+		state->tail_len = 0;
+		p += fill;
+		len -= fill;
+	}
+	
+	hash_stripes(state, p, len / 32);
+	p += len & ~(size_t)31;
+	len &= 31;
+	
+	memcpy(state->tail, p, len);
+	state->tail_len = len;
+}
+
+static uint64_t hash_final(const HashState* state)
+{
+	uint64_t h;
+	
+	if(state->total >= 32) {
+		h = rotl64(state->acc[0], 1) + rotl64(state->acc[1], 7) + rotl64(state->acc[2], 12) + rotl64(state->acc[3], 18);
+		h = xxh_merge(h, state->acc[0]);
+		h = xxh_merge(h, state->acc[1]);
+		h = xxh_merge(h, state->acc[2]);
+		h = xxh_merge(h, state->acc[3]);
+	} else {
+		h = state->seed + XXH_PRIME5;
+	}
+	
+	h += state->total;
+	
+	const uint8_t* p = state->tail;
+	size_t len = state->tail_len;
+	
+	for(; len >= 8; p += 8, len -= 8) {
+		h ^= xxh_round(0, read64(p));
+		h = (rotl64(h, 27) * XXH_PRIME1) + XXH_PRIME4;
+	}
+	
+	if(len >= 4) {
+		h ^= (uint64_t)read32(p) * XXH_PRIME1;
+		h = (rotl64(h, 23) * XXH_PRIME2) + XXH_PRIME3;
+		p += 4;
+		len -= 4;
+	}
+	
+	for(; len > 0; p++, len--) {
+		h ^= (*p) * XXH_PRIME5;
+		h = rotl64(h, 11) * XXH_PRIME1;
+	}
+	
+	h ^= h >> 33;
+	h *= XXH_PRIME2;
+	h ^= h >> 29;
+	h *= XXH_PRIME3;
+	h ^= h >> 32;
+	
+	return h;
+}
+
+uint64_t ppm_hash(const PPM_Image* img)
+{
+	int width = img->header.width;
+	int height = img->header.height;
+	HashState state;
+	hash_init(&state, ((uint64_t)(uint32_t)width << 32) | (uint32_t)height);
+	
+	if(img->layout == PPM_LAYOUT_LINEAR) {
+		hash_update(&state, (const uint8_t*)img->buffer, sizeof(PPM_Pixel) * (size_t)width * height);
+	} else {
+		int y;
+		for(y = 0; y < height; y++) {
+			int x = 0;
+			
+			while(x < width) {
+				int run;
+				const PPM_Pixel* src = ppm_run(img, x, y, &run);
+				run = min(run, width - x);
+				hash_update(&state, (const uint8_t*)src, sizeof(PPM_Pixel) * run);
+				x += run;
+			}
+		}
+	}
+	
+	return hash_final(&state);
+}
+
+// Rows are compared in parallel; every pool thread folds the rows it handles
+// into its own partial result, and the partials are combined at the end.
+typedef struct {
+	PPM_Diff diff;
+	uint64_t squared_error;
+} DiffPartial;
+
+typedef struct {
+	const PPM_Image* a;
+	const PPM_Image* b;
+	DiffPartial* partials;
+} DiffJob;
+
+static void diff_row(const PPM_Pixel* a, const PPM_Pixel* b, int x0, int n, int y, DiffPartial* part)
+{
+	int i;
+	for(i = 0; i < n; i++) {
+		int dr = abs(a[i].r - b[i].r);
+		int dg = abs(a[i].g - b[i].g);
+		int db = abs(a[i].b - b[i].b);
+		int err = max(dr, max(dg, db));
+		
+		part->squared_error += (uint64_t)((dr * dr) + (dg * dg) + (db * db));
+		
+		if(err) {
+			int x = x0 + i;
+			part->diff.changed++;
+			part->diff.max_error = max(part->diff.max_error, err);
+			part->diff.x_min = min(part->diff.x_min, x);
+			part->diff.x_max = max(part->diff.x_max, x);
+			part->diff.y_min = min(part->diff.y_min, y);
+			part->diff.y_max = max(part->diff.y_max, y);
+		}
+	}
+}
+
+static bool diff_rows(int begin, int end, void* ctx)
+{
+	DiffJob* job = ctx;
+	DiffPartial* part = &job->partials[pool_thread_index()];
+	int width = job->a->header.width;
+	
+	int y;
+	for(y = begin; y < end; y++) {
+		int x = 0;
+		
+		while(x < width) {
+			int run_a, run_b;
+			const PPM_Pixel* pa = ppm_run(job->a, x, y, &run_a);
+			const PPM_Pixel* pb = ppm_run(job->b, x, y, &run_b);
+			int run = min(width - x, min(run_a, run_b));
+			
+			if(memcmp(pa, pb, sizeof(PPM_Pixel) * run) != 0) {
+				diff_row(pa, pb, x, run, y, part);
+			}
+			x += run;
+		}
+	}
+	
+	return true;
+}
+
+PPM_Diff ppm_diff(const PPM_Image* a, const PPM_Image* b)
+{
+	PPM_Diff result = { 0, INT_MAX, INT_MAX, -1, -1, 0, INFINITY };
+	
+	if(a->header.width != b->header.width || a->header.height != b->header.height) {
+		fprintf(stderr, "Error: ppm_diff on images of different sizes.\n");
+		result.changed = (size_t)max(a->header.width, b->header.width) * max(a->header.height, b->header.height);
+		result.x_min = 0;
+		result.y_min = 0;
+		result.x_max = max(a->header.width, b->header.width) - 1;
+		result.y_max = max(a->header.height, b->header.height) - 1;
+		result.max_error = 255;
+		result.psnr = 0;
+		return result;
+	}
+	
+	int n_threads = pool_thread_count();
+	DiffJob job = { a, b, malloc(sizeof(DiffPartial) * n_threads) };
+	
+	if(!job.partials) {
+		fprintf(stderr, "Error: failed to allocate diff state.\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	int i;
+	for(i = 0; i < n_threads; i++) {
+		job.partials[i].diff = result;
+		job.partials[i].squared_error = 0;
+	}
+	
+	parallel_for(0, a->header.height, max(1, a->header.height / (n_threads * 4)), diff_rows, &job);
+	
+	uint64_t squared_error = 0;
+	
+	for(i = 0; i < n_threads; i++) {
+		PPM_Diff* part = &job.partials[i].diff;
+		result.changed += part->changed;
+		result.max_error = max(result.max_error, part->max_error);
+		result.x_min = min(result.x_min, part->x_min);
+		result.y_min = min(result.y_min, part->y_min);
+		result.x_max = max(result.x_max, part->x_max);
+		result.y_max = max(result.y_max, part->y_max);
+		squared_error += job.partials[i].squared_error;
+	}
+	
+	free(job.partials);
+	
+	if(squared_error > 0) {
+		double mse = (double)squared_error / ((double)a->header.width * a->header.height * 3);
+		result.psnr = 10.0 * log10((255.0 * 255.0) / mse);
+	}
+	
+	return result;
+}
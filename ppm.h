@@ -22,21 +22,156 @@ typedef struct {
 	uint8_t b;
 } PPM_Pixel;
 
+// Optional depth buffer for 3D drawing. tile_max holds the farthest depth in
+// each 8x8 block of values so whole blocks can be rejected at once.
+typedef struct {
+	float* values;
+	float* tile_max;
+	int tiles_x;
+	int tiles_y;
+} PPM_Depth;
+
+// Pixel storage order. Tiled images keep 8x8 blocks of pixels together (each
+// block row-major, blocks row-major across the image) so vertical and other
+// 2D-local access stays within a few cache lines. Always go through
+// ppm_index() or ppm_run() rather than indexing buffer by hand.
+typedef enum {
+	PPM_LAYOUT_LINEAR,
+	PPM_LAYOUT_TILED
+} PPM_Layout;
+
+#define PPM_TILE_SHIFT 3
+#define PPM_TILE_SIZE (1 << PPM_TILE_SHIFT)
+#define PPM_TILE_MASK (PPM_TILE_SIZE - 1)
+
+// Colour space translucent drawing mixes in. The buffer always holds sRGB
+// bytes; PPM_BLEND_LINEAR decodes them to linear light before mixing, which
+// keeps overlays from darkening the way plain byte interpolation does.
+typedef enum {
+	PPM_BLEND_SRGB,
+	PPM_BLEND_LINEAR
+} PPM_BlendSpace;
+
+// How translucent drawing combines a color c with the destination d (per
+// channel, as fractions of full intensity) before mixing by alpha:
+// normal c, add min(d + c, 1), multiply d * c, screen 1 - (1 - d) * (1 - c),
+// min and max.
+typedef enum {
+	PPM_BLEND_NORMAL,
+	PPM_BLEND_ADD,
+	PPM_BLEND_MULTIPLY,
+	PPM_BLEND_SCREEN,
+	PPM_BLEND_MIN,
+	PPM_BLEND_MAX
+} PPM_BlendMode;
+
+// Expected access pattern for a mapped image, passed on to the kernel so it
+// can read ahead or not.
+typedef enum {
+	PPM_ACCESS_NORMAL,
+	PPM_ACCESS_SEQUENTIAL,
+	PPM_ACCESS_RANDOM
+} PPM_Access;
+
+// map is non-NULL for images created by ppm_create_mapped(); buffer then
+// points into it, just past the file header. map_dev and map_ino identify the
+// mapped file however it is named.
 typedef struct {
 	PPM_Header header;
 	PPM_Pixel* buffer;
+	PPM_Depth* depth;
+	PPM_Layout layout;
+	PPM_BlendSpace blend_space;
+	PPM_BlendMode blend_mode;
+	int tiles_x;
+	void* map;
+	size_t map_size;
+	char* map_path;
+	uint64_t map_dev;
+	uint64_t map_ino;
 } PPM_Image;
 
+// Result of ppm_diff. The bounding box is inclusive and only meaningful when
+// changed > 0; psnr is INFINITY for identical images.
+typedef struct {
+	size_t changed;
+	int x_min;
+	int y_min;
+	int x_max;
+	int y_max;
+	int max_error;
+	double psnr;
+} PPM_Diff;
+
+typedef enum {
+	PPM_FORMAT_P2,		// ASCII greyscale
+	PPM_FORMAT_P3,		// ASCII RGB
+	PPM_FORMAT_P5,		// binary greyscale
+	PPM_FORMAT_P6,		// binary RGB, 8 bits per channel
+	PPM_FORMAT_P6_16	// binary RGB, 16 bits per channel
+} PPM_Format;
+
 PPM_Pixel ppm_rgb(int r, int g, int b);
 
 PPM_Image* ppm_create(int w, int h);
+PPM_Image* ppm_create_layout(int w, int h, PPM_Layout layout);
 void ppm_destroy(PPM_Image* img);
 
+// Creates a w x h P6 file at path and maps it, using its pixel data as the
+// image buffer, so drawing goes straight to the page cache and canvases can
+// outgrow memory. Mapped images are always linear. Saving one as P6 to its
+// own file just flushes it with ppm_sync(); other formats can't be written
+// over the mapped file. Returns NULL on failure.
+PPM_Image* ppm_create_mapped(const char* path, int w, int h);
+void ppm_sync(PPM_Image* img);
+void ppm_advise(PPM_Image* img, PPM_Access access);
+
 void ppm_set_pixel(PPM_Image* img, int x, int y, PPM_Pixel pixel);
 void ppm_set_rgb(PPM_Image* img, int x, int y, int r, int g, int b);
 PPM_Pixel ppm_get_pixel(const PPM_Image* img, int x, int y);
 
+static inline size_t ppm_tiled_index(const PPM_Image* img, int x, int y)
+{
+	size_t tile = ((size_t)(y >> PPM_TILE_SHIFT) * img->tiles_x) + (x >> PPM_TILE_SHIFT);
+	
+	return (tile << (2 * PPM_TILE_SHIFT)) + ((y & PPM_TILE_MASK) << PPM_TILE_SHIFT) + (x & PPM_TILE_MASK);
+}
+
+// Buffer index of pixel (x, y); no bounds checking.
+static inline size_t ppm_index(const PPM_Image* img, int x, int y)
+{
+	if(img->layout == PPM_LAYOUT_LINEAR) {
+		return ((size_t)y * img->header.width) + x;
+	}
+	
+	return ppm_tiled_index(img, x, y);
+}
+
+// Pointer to pixel (x, y), with *run set to how many pixels from x onwards
+// along row y are stored contiguously. Span loops walk a row run by run.
+static inline PPM_Pixel* ppm_run(const PPM_Image* img, int x, int y, int* run)
+{
+	if(img->layout == PPM_LAYOUT_LINEAR) {
+		*run = img->header.width - x;
+	} else {
+		*run = PPM_TILE_SIZE - (x & PPM_TILE_MASK);
+	}
+	
+	return &img->buffer[ppm_index(img, x, y)];
+}
+
+// Copy one row between the image and a plain row-major array, whatever the
+// image's layout.
+void ppm_read_row(const PPM_Image* img, int y, PPM_Pixel* out);
+void ppm_write_row(PPM_Image* img, int y, const PPM_Pixel* in);
+
 void ppm_save(PPM_Image* img, const char* filename);
+void ppm_save_format(PPM_Image* img, const char* filename, PPM_Format format);
 PPM_Image* ppm_load(const char* filename);
 
+// 64-bit content hash of the pixels in row order (independent of layout) and
+// the dimensions. Equal images always hash equal.
+uint64_t ppm_hash(const PPM_Image* img);
+PPM_Diff ppm_diff(const PPM_Image* a, const PPM_Image* b);
+
 #endif //PPM_H
@@ -0,0 +1,602 @@
+// Batch renderer: reads a scene file describing any number of output images
+// and renders them all in one process, running independent images
+// concurrently on the thread pool.
+//
+// Usage: render [-j threads] [-u] <scene-file>
+//
+// With -u, an image whose output file already holds identical pixels is not
+// rewritten.
+//
+// Scene files are line based; '#' starts a comment. Coordinates use the same
+// bottom-left origin as draw.h, colors are 0-255 and alpha is optional
+// (default 1, which draws opaque).
+//
+//   texture <name> <file.ppm>          load once, usable by every image
+//   image <output.ppm> <w> <h> [r g b] start an image with a background color
+//   point x y r g b [alpha]
+//   line x1 y1 x2 y2 r g b [alpha]
+//   circle x y radius r g b fill|outline [alpha]
+//   triangle x1 y1 x2 y2 x3 y3 r g b fill|outline [alpha]
+//   blit <name> x0 y0 x1 y1 [alpha]    stretch a whole texture over a rect
+//   noise x_scale y_scale persistence octaves [alpha]
+//   blend [mode] [srgb|linear]         how later draws combine with the image:
+//                                      mode is normal (default), add, multiply,
+//                                      screen, min or max
+//   end                                finish the current image
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "ppm.h"
+#include "draw.h"
+#include "pool.h"
+#include "noise.h"
+#include <string.h>
+#include <time.h>
+
+#define MAX_TOKENS 16
+#define MAX_LINE 4096
+
+typedef enum {
+	CMD_POINT,
+	CMD_LINE,
+	CMD_CIRCLE,
+	CMD_TRIANGLE,
+	CMD_BLIT,
+	CMD_NOISE,
+	CMD_BLEND
+} CommandType;
+
+typedef struct {
+	CommandType type;
+	float args[6];
+	ColorRGB color;
+	float alpha;
+	bool filled;
+	int octaves;
+	int texture;
+	PPM_BlendSpace space;
+	PPM_BlendMode mode;
+} Command;
+
+typedef struct {
+	char* output;
+	int width;
+	int height;
+	ColorRGB background;
+	Command* commands;
+	int n_commands;
+	int cap_commands;
+	double millis;
+	bool unchanged;
+} Job;
+
+typedef struct {
+	char* name;
+	Image* image;
+} Texture;
+
+typedef struct {
+	Job* jobs;
+	int n_jobs;
+	int cap_jobs;
+	Texture* textures;
+	int n_textures;
+	int cap_textures;
+	Image** scratch;
+	int n_scratch;
+	bool skip_unchanged;
+} Scene;
+
+static void* grow(void* array, int* cap, size_t elem_size)
+{
+	*cap = (*cap == 0) ? 16 : (*cap * 2);
+	void* grown = realloc(array, elem_size * (*cap));
+	
+	if(!grown) {
+		fprintf(stderr, "Error: out of memory while reading scene.\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	return grown;
+}
+
+static char* copy_string(const char* s)
+{
+	char* copy = malloc(strlen(s) + 1);
+	
+	if(!copy) {
+		fprintf(stderr, "Error: out of memory while reading scene.\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	return strcpy(copy, s);
+}
+
+static void scene_error(const char* path, int line, const char* message)
+{
+	fprintf(stderr, "Error: %s:%d: %s\n", path, line, message);
+	exit(EXIT_FAILURE);
+}
+
+static int find_texture(const Scene* scene, const char* name)
+{
+	int i;
+	for(i = 0; i < scene->n_textures; i++) {
+		if(strcmp(scene->textures[i].name, name) == 0) {
+			return i;
+		}
+	}
+	
+	return -1;
+}
+
+static bool parse_floats(char** tokens, int count, float* out)
+{
+	int i;
+	for(i = 0; i < count; i++) {
+		char* end;
+		out[i] = strtof(tokens[i], &end);
+		
+		if(end == tokens[i] || *end != '\0') {
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+static bool parse_color(char** tokens, ColorRGB* color)
+{
+	float c[3];
+	
+	if(!parse_floats(tokens, 3, c)) {
+		return false;
+	}
+	
+	*color = rgb((int)c[0], (int)c[1], (int)c[2]);
+	return true;
+}
+
+static bool parse_fill(const char* token, bool* filled)
+{
+	if(strcmp(token, "fill") == 0) {
+		*filled = true;
+	} else if(strcmp(token, "outline") == 0) {
+		*filled = false;
+	} else {
+		return false;
+	}
+	
+	return true;
+}
+
+// Parses the optional trailing alpha that follows the required tokens.
+static bool parse_alpha(char** tokens, int n_tokens, int required, float* alpha)
+{
+	*alpha = 1.0f;
+	
+	if(n_tokens == required) {
+		return true;
+	}
+	
+	if(n_tokens != required + 1) {
+		return false;
+	}
+	
+	return parse_floats(&tokens[required], 1, alpha);
+}
+
+static bool parse_blend(const char* token, PPM_BlendSpace* space, PPM_BlendMode* mode)
+{
+	static const char* modes[] = { "normal", "add", "multiply", "screen", "min", "max" };
+	
+	if(strcmp(token, "srgb") == 0) {
+		*space = PPM_BLEND_SRGB;
+		return true;
+	}
+	
+	if(strcmp(token, "linear") == 0) {
+		*space = PPM_BLEND_LINEAR;
+		return true;
+	}
+	
+	int i;
+	for(i = 0; i <= PPM_BLEND_MAX; i++) {
+		if(strcmp(token, modes[i]) == 0) {
+			*mode = (PPM_BlendMode)i;
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+static void parse_command(Scene* scene, Job* job, char** tokens, int n, const char* path, int line)
+{
+	Command cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	bool ok = false;
+	
+	if(strcmp(tokens[0], "point") == 0) {
+		cmd.type = CMD_POINT;
+		ok = n >= 6 && parse_floats(&tokens[1], 2, cmd.args) && parse_color(&tokens[3], &cmd.color) &&
+			parse_alpha(tokens, n, 6, &cmd.alpha);
+	} else if(strcmp(tokens[0], "line") == 0) {
+		cmd.type = CMD_LINE;
+		ok = n >= 8 && parse_floats(&tokens[1], 4, cmd.args) && parse_color(&tokens[5], &cmd.color) &&
+			parse_alpha(tokens, n, 8, &cmd.alpha);
+	} else if(strcmp(tokens[0], "circle") == 0) {
+		cmd.type = CMD_CIRCLE;
+		ok = n >= 8 && parse_floats(&tokens[1], 3, cmd.args) && parse_color(&tokens[4], &cmd.color) &&
+			parse_fill(tokens[7], &cmd.filled) && parse_alpha(tokens, n, 8, &cmd.alpha);
+	} else if(strcmp(tokens[0], "triangle") == 0) {
+		cmd.type = CMD_TRIANGLE;
+		ok = n >= 11 && parse_floats(&tokens[1], 6, cmd.args) && parse_color(&tokens[7], &cmd.color) &&
+			parse_fill(tokens[10], &cmd.filled) && parse_alpha(tokens, n, 11, &cmd.alpha);
+	} else if(strcmp(tokens[0], "blit") == 0) {
+		cmd.type = CMD_BLIT;
+		ok = n >= 6 && parse_floats(&tokens[2], 4, cmd.args) && parse_alpha(tokens, n, 6, &cmd.alpha);
+		
+		if(ok) {
+			cmd.texture = find_texture(scene, tokens[1]);
+			
+			if(cmd.texture < 0) {
+				scene_error(path, line, "unknown texture");
+			}
+		}
+	} else if(strcmp(tokens[0], "noise") == 0) {
+		float octaves;
+		cmd.type = CMD_NOISE;
+		ok = n >= 5 && parse_floats(&tokens[1], 3, cmd.args) && parse_floats(&tokens[4], 1, &octaves) &&
+			parse_alpha(tokens, n, 5, &cmd.alpha);
+		cmd.octaves = (int)octaves;
+	} else if(strcmp(tokens[0], "blend") == 0) {
+		cmd.type = CMD_BLEND;
+		ok = n <= 3;
+		
+		int i;
+		for(i = 1; i < n && ok; i++) {
+			ok = parse_blend(tokens[i], &cmd.space, &cmd.mode);
+		}
+	} else {
+		scene_error(path, line, "unknown command");
+	}
+	
+	if(!ok) {
+		scene_error(path, line, "malformed arguments");
+	}
+	
+	if(job->n_commands == job->cap_commands) {
+		job->commands = grow(job->commands, &job->cap_commands, sizeof(Command));
+	}
+	job->commands[job->n_commands++] = cmd;
+}
+
+static void load_scene(Scene* scene, const char* path)
+{
+	FILE* in = fopen(path, "r");
+	
+	if(!in) {
+		fprintf(stderr, "Error opening scene file %s.\n", path);
+		exit(EXIT_FAILURE);
+	}
+	
+	char buf[MAX_LINE];
+	int line = 0;
+	Job* job = NULL;
+	
+	while(fgets(buf, sizeof(buf), in)) {
+		line++;
+		
+		char* comment = strchr(buf, '#');
+		if(comment) {
+			*comment = '\0';
+		}
+		
+		char* tokens[MAX_TOKENS];
+		int n = 0;
+		char* tok;
+		for(tok = strtok(buf, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+			if(n == MAX_TOKENS) {
+				scene_error(path, line, "too many arguments");
+			}
+			tokens[n++] = tok;
+		}
+		
+		if(n == 0) {
+			continue;
+		}
+		
+		if(strcmp(tokens[0], "texture") == 0) {
+			if(n != 3) {
+				scene_error(path, line, "expected: texture <name> <file.ppm>");
+			}
+			
+			if(find_texture(scene, tokens[1]) >= 0) {
+				scene_error(path, line, "texture already defined");
+			}
+			
+			Image* image = ppm_load(tokens[2]);
+			
+			if(!image) {
+				scene_error(path, line, "failed to load texture");
+			}
+			
+			if(scene->n_textures == scene->cap_textures) {
+				scene->textures = grow(scene->textures, &scene->cap_textures, sizeof(Texture));
+			}
+			scene->textures[scene->n_textures++] = (Texture) { copy_string(tokens[1]), image };
+		} else if(strcmp(tokens[0], "image") == 0) {
+			float dims[2];
+			
+			if(job) {
+				scene_error(path, line, "image started before the previous one ended");
+			}
+			
+			if((n != 4 && n != 7) || !parse_floats(&tokens[2], 2, dims) || dims[0] < 1 || dims[1] < 1) {
+				scene_error(path, line, "expected: image <output.ppm> <w> <h> [r g b]");
+			}
+			
+			if(scene->n_jobs == scene->cap_jobs) {
+				scene->jobs = grow(scene->jobs, &scene->cap_jobs, sizeof(Job));
+			}
+			
+			job = &scene->jobs[scene->n_jobs++];
+			memset(job, 0, sizeof(Job));
+			job->output = copy_string(tokens[1]);
+			job->width = (int)dims[0];
+			job->height = (int)dims[1];
+			
+			if(n == 7 && !parse_color(&tokens[4], &job->background)) {
+				scene_error(path, line, "malformed background color");
+			}
+		} else if(strcmp(tokens[0], "end") == 0) {
+			if(!job) {
+				scene_error(path, line, "end without image");
+			}
+			job = NULL;
+		} else {
+			if(!job) {
+				scene_error(path, line, "drawing command outside of an image");
+			}
+			parse_command(scene, job, tokens, n, path, line);
+		}
+	}
+	
+	if(job) {
+		scene_error(path, line, "missing end for the last image");
+	}
+	
+	fclose(in);
+}
+
+static double now_millis(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (ts.tv_sec * 1000.0) + (ts.tv_nsec / 1000000.0);
+}
+
+static void draw_noise(Image* image, const Command* cmd)
+{
+	// Library rows run from 1 at the bottom to height at the top.
+	int x, y;
+	for(y = 1; y <= image->header.height; y++) {
+		for(x = 0; x < image->header.width; x++) {
+			float value = Perlin2D(x / cmd->args[0], y / cmd->args[1], cmd->args[2], cmd->octaves);
+			int grey = (int)((value * 255) + 0.5f);
+			
+			if(cmd->alpha >= 1.0f && image->blend_mode == PPM_BLEND_NORMAL) {
+				draw_point(image, point2(x, y), rgb(grey, grey, grey));
+			} else {
+				draw_point_alpha(image, point2(x, y), rgb(grey, grey, grey), cmd->alpha);
+			}
+		}
+	}
+}
+
+static void run_command(const Scene* scene, Image* image, const Command* cmd)
+{
+	const float* a = cmd->args;
+	// Only plain opaque drawing can skip the blending paths.
+	bool opaque = cmd->alpha >= 1.0f && image->blend_mode == PPM_BLEND_NORMAL;
+	
+	switch(cmd->type) {
+		case CMD_POINT:
+			if(opaque) {
+				draw_point(image, point2(a[0], a[1]), cmd->color);
+			} else {
+				draw_point_alpha(image, point2(a[0], a[1]), cmd->color, cmd->alpha);
+			}
+			break;
+		case CMD_LINE:
+			if(opaque) {
+				draw_line(image, point2(a[0], a[1]), point2(a[2], a[3]), cmd->color);
+			} else {
+				draw_line_alpha(image, point2(a[0], a[1]), point2(a[2], a[3]), cmd->color, cmd->alpha);
+			}
+			break;
+		case CMD_CIRCLE:
+			if(opaque) {
+				draw_circle(image, point2(a[0], a[1]), a[2], cmd->color, cmd->filled);
+			} else {
+				draw_circle_alpha(image, point2(a[0], a[1]), a[2], cmd->color, cmd->alpha, cmd->filled);
+			}
+			break;
+		case CMD_TRIANGLE: {
+			Triangle2D tri = { point2(a[0], a[1]), point2(a[2], a[3]), point2(a[4], a[5]) };
+			
+			if(opaque) {
+				draw_triangle(image, tri, cmd->color, cmd->filled);
+			} else {
+				draw_triangle_alpha(image, tri, cmd->color, cmd->alpha, cmd->filled);
+			}
+			break;
+		}
+		case CMD_BLIT: {
+			const Image* tex = scene->textures[cmd->texture].image;
+			Rect2D src_rect = { point2(0, 0), point2(tex->header.width, tex->header.height) };
+			Rect2D dest_rect = { point2(a[0], a[1]), point2(a[2], a[3]) };
+			
+			if(opaque) {
+				blit(image, dest_rect, tex, src_rect);
+			} else {
+				blit_alpha(image, dest_rect, tex, src_rect, cmd->alpha);
+			}
+			break;
+		}
+		case CMD_NOISE:
+			draw_noise(image, cmd);
+			break;
+		case CMD_BLEND:
+			image->blend_space = cmd->space;
+			image->blend_mode = cmd->mode;
+			break;
+	}
+}
+
+// Each pool thread keeps one scratch canvas and only reallocates it when a
+// job needs different dimensions.
+static Image* scratch_image(Scene* scene, int width, int height)
+{
+	Image** slot = &scene->scratch[pool_thread_index()];
+	
+	if(!*slot || (*slot)->header.width != width || (*slot)->header.height != height) {
+		ppm_destroy(*slot);
+		*slot = ppm_create(width, height);
+	}
+	
+	return *slot;
+}
+
+static bool output_matches(const Image* image, const char* path)
+{
+	FILE* existing = fopen(path, "rb");
+	
+	if(!existing) {
+		return false;
+	}
+	fclose(existing);
+	
+	Image* previous = ppm_load(path);
+	
+	if(!previous) {
+		return false;
+	}
+	
+	bool same = previous->header.width == image->header.width &&
+		previous->header.height == image->header.height &&
+		ppm_hash(previous) == ppm_hash(image);
+	
+	ppm_destroy(previous);
+	
+	return same;
+}
+
+static bool render_jobs(int begin, int end, void* ctx)
+{
+	Scene* scene = ctx;
+	
+	int j;
+	for(j = begin; j < end; j++) {
+		Job* job = &scene->jobs[j];
+		double start = now_millis();
+		
+		Image* image = scratch_image(scene, job->width, job->height);
+		image->blend_space = PPM_BLEND_SRGB;
+		image->blend_mode = PPM_BLEND_NORMAL;
+		
+		size_t p;
+		size_t n_pixels = (size_t)image->header.width * image->header.height;
+		for(p = 0; p < n_pixels; p++) {
+			image->buffer[p] = job->background;
+		}
+		
+		int i;
+		for(i = 0; i < job->n_commands; i++) {
+			run_command(scene, image, &job->commands[i]);
+		}
+		
+		job->unchanged = scene->skip_unchanged && output_matches(image, job->output);
+		
+		if(!job->unchanged) {
+			ppm_save(image, job->output);
+		}
+		
+		job->millis = now_millis() - start;
+	}
+	
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	int threads = -1;
+	bool skip_unchanged = false;
+	const char* path = NULL;
+	
+	int i;
+	for(i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			threads = atoi(argv[++i]) - 1;
+		} else if(strcmp(argv[i], "-u") == 0) {
+			skip_unchanged = true;
+		} else if(!path) {
+			path = argv[i];
+		} else {
+			path = NULL;
+			break;
+		}
+	}
+	
+	if(!path) {
+		fprintf(stderr, "Usage: %s [-j threads] [-u] <scene-file>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	
+	pool_init(max(threads, -1));
+	
+	Scene scene;
+	memset(&scene, 0, sizeof(scene));
+	load_scene(&scene, path);
+	scene.skip_unchanged = skip_unchanged;
+	
+	scene.n_scratch = pool_thread_count();
+	scene.scratch = calloc(scene.n_scratch, sizeof(Image*));
+	
+	if(!scene.scratch) {
+		fprintf(stderr, "Error: failed to allocate scratch images.\n");
+		return EXIT_FAILURE;
+	}
+	
+	double start = now_millis();
+	parallel_for(0, scene.n_jobs, 1, render_jobs, &scene);
+	double total = now_millis() - start;
+	
+	for(i = 0; i < scene.n_jobs; i++) {
+		printf("%s: %.3f ms%s\n", scene.jobs[i].output, scene.jobs[i].millis, scene.jobs[i].unchanged ? " (unchanged)" : "");
+	}
+	printf("%d images in %.3f ms on %d threads\n", scene.n_jobs, total, scene.n_scratch);
+	
+	for(i = 0; i < scene.n_scratch; i++) {
+		ppm_destroy(scene.scratch[i]);
+	}
+	free(scene.scratch);
+	
+	for(i = 0; i < scene.n_jobs; i++) {
+		free(scene.jobs[i].output);
+		free(scene.jobs[i].commands);
+	}
+	free(scene.jobs);
+	
+	for(i = 0; i < scene.n_textures; i++) {
+		free(scene.textures[i].name);
+		ppm_destroy(scene.textures[i].image);
+	}
+	free(scene.textures);
+	
+	pool_shutdown();
+	
+	return 0;
+}
@@ -1,11 +1,9 @@
 #include "ppm.h"
 #include "draw.h"
+#include "pool.h"
+#include "noise.h"
 #include "math.h"
 
-#ifndef M_PI
-#define M_PI 3.14159265358979323846
-#endif
-
 static int floor_i(float f)
 {
 	return (int)(f);
@@ -32,31 +30,18 @@ static float remainder_frac(float f)
 
 ColorRGB color_field(Point2D point);
 ColorRGB heightmap(Point2D point);
-
-float noise_2D(int x, int y);
-float smooth_noise_2D(int x, int y);
-float interpolated_noise(float x, float y);
-float cos_interp(float x, float y, float a);
-float Perlin2D(float x, float y, float pers, int n_oct);
+bool heightmap_rows(Image* image, int y_begin, int y_end, void* ctx);
 
 int main(int argc, char** argv)
 {	
+	pool_init(-1);
+	
 	Image* image = ppm_create(1024, 1024);
 	Image* smaller = ppm_create(128, 128);
 	
+	parallel_for_rows(image, 0, heightmap_rows, NULL);
+	
 	int x, y;
-	for(y = 0; y < image->header.height; y++) {
-		for(x = 0; x < image->header.width; x++) {
-			Point2D pix = point2(x, y);
-			float x_scale = image->header.width / 8.0f;
-			float y_scale = image->header.height / 8.0f;
-			Point2D samp = point2((pix.x + 512) / x_scale, (pix.y + 512) / y_scale);
-			//ColorRGB color = color_field(samp);
-			ColorRGB height = heightmap(samp);
-			//ColorRGB blended = blend(color, height, 0.1f);
-			draw_point(image, pix, height);
-		}
-	}
 
 	for(y = 0; y < smaller->header.height; y++) {
 		for(x = 0; x < image->header.width; x++) {
@@ -79,22 +64,34 @@ int main(int argc, char** argv)
 	ppm_destroy(smaller);
 	ppm_destroy(image);
 	
+	pool_shutdown();
+	
 	return 0;
 }
 
-ColorRGB heightmap(Point2D point)
+bool heightmap_rows(Image* image, int y_begin, int y_end, void* ctx)
 {
-	static int init = 0;
-	static ColorRGB greyscale[256];
+	(void)ctx;
 	
-	if(!init) {
-		int i;
-		for(i = 0; i < 256; i++) {
-			greyscale[i] = rgb(i, i, i);
+	int x, y;
+	for(y = y_begin; y < y_end; y++) {
+		for(x = 0; x < image->header.width; x++) {
+			Point2D pix = point2(x, y);
+			float x_scale = image->header.width / 8.0f;
+			float y_scale = image->header.height / 8.0f;
+			Point2D samp = point2((pix.x + 512) / x_scale, (pix.y + 512) / y_scale);
+			//ColorRGB color = color_field(samp);
+			ColorRGB height = heightmap(samp);
+			//ColorRGB blended = blend(color, height, 0.1f);
+			draw_point(image, pix, height);
 		}
-		init = 1;
 	}
 	
+	return true;
+}
+
+ColorRGB heightmap(Point2D point)
+{
 	float color_percent = Perlin2D(point.x, point.y, 0.5, 10);
 	
 	if(color_percent < 0) {
@@ -109,7 +106,7 @@ ColorRGB heightmap(Point2D point)
 	
 	int rounded = round_i(color_percent);
 	
-	return greyscale[rounded];
+	return rgb(rounded, rounded, rounded);
 }
 
 ColorRGB color_field(Point2D point)
@@ -166,68 +163,3 @@ ColorRGB color_field(Point2D point)
 	
 	return blend(colors[bg], colors[fg], alpha);
 }
-
-float noise_2D(int x, int y)
-{
-	int n = x + y * 57;
-	n = (n << 13) ^ n;
-	return 1.0f - ( ((n * (n * n * 15731 + 789221) + 1376312589) & 0x7FFFFFFF) / 1073741824.0f);
-}
-
-float smooth_noise_2D(int x, int y)
-{
-	int x0 = x-1;
-	int x1 = x+1;
-	int y0 = y-1;
-	int y1 = y+1;
-	
-	float corners = (noise_2D(x0, y0) + noise_2D(x1, y0) + noise_2D(x0, y1) + noise_2D(x1, y1)) / 16.0f;
-	float sides = (noise_2D(x0, y) + noise_2D(x1, y) + noise_2D(x, y0) + noise_2D(x, y1)) / 8.0f;
-	float center = noise_2D(x, y);
-	
-	return center + sides + corners;
-}
-
-float interpolated_noise(float x, float y)
-{
-	int x_ = floor_i(x);
-	int y_ = floor_i(y);
-	
-	float frac_x = frac(x);
-	float frac_y = frac(y);
-	
-	float v1 = smooth_noise_2D(x_, y_);
-	float v2 = smooth_noise_2D(x_ + 1, y_);
-	float v3 = smooth_noise_2D(x_, y_ + 1);
-	float v4 = smooth_noise_2D(x_ + 1, y_ + 1);
-	
-	float i1 = cos_interp(v1, v2, frac_x);
-	float i2 = cos_interp(v3, v4, frac_x);
-	
-	return cos_interp(i1, i2, frac_y);
-}
-
-float cos_interp(float a, float b, float t)
-{
-	float theta = t * M_PI;
-	float f = (1.0f - cos(theta)) * 0.5f;
-
-	return (1.0f - f) * a + f * b;
-}
-
-float Perlin2D(float x, float y, float persistence, int n_octave)
-{
-	float total = 0;
-	float p = persistence;
-	
-	int i;
-	for(i = 0; i < n_octave; i++) {
-		
-		float freq = pow(2, i);
-		float ampl = pow(p, i);
-		
-		total += interpolated_noise(x * freq, y * freq) * ampl;
-	}
-	
-	return total;
-}
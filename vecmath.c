@@ -0,0 +1,319 @@
+#include "vecmath.h"
+#include <string.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#define VECMATH_SSE 1
+#endif
+
+#define ARRAY_ALIGN 64
+
+static float* alloc_floats(size_t count)
+{
+	size_t bytes = sizeof(float) * count;
+	bytes = (bytes + ARRAY_ALIGN - 1) & ~(size_t)(ARRAY_ALIGN - 1);
+	
+	float* a = aligned_alloc(ARRAY_ALIGN, bytes ? bytes : ARRAY_ALIGN);
+	
+	if(!a) {
+		fprintf(stderr, "Error: failed to allocate vector array.\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	memset(a, 0, bytes);
+	
+	return a;
+}
+
+Vec2Array vec2_array_create(size_t count)
+{
+	return (Vec2Array) { alloc_floats(count), alloc_floats(count), count };
+}
+
+void vec2_array_destroy(Vec2Array* a)
+{
+	free(a->x);
+	free(a->y);
+	a->x = NULL;
+	a->y = NULL;
+	a->count = 0;
+}
+
+Vec3Array vec3_array_create(size_t count)
+{
+	return (Vec3Array) { alloc_floats(count), alloc_floats(count), alloc_floats(count), count };
+}
+
+void vec3_array_destroy(Vec3Array* a)
+{
+	free(a->x);
+	free(a->y);
+	free(a->z);
+	a->x = NULL;
+	a->y = NULL;
+	a->z = NULL;
+	a->count = 0;
+}
+
+// Each kernel runs four lanes at a time with SSE where available and
+// finishes the remainder (or everything, without SSE) with the scalar loop.
+
+static void add_floats(float* out, const float* l, const float* r, size_t n)
+{
+	size_t i = 0;
+
+#ifdef VECMATH_SSE
+	for(; i + 4 <= n; i += 4) {
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(l + i), _mm_loadu_ps(r + i)));
+	}
+#endif
+	
+	for(; i < n; i++) {
+		out[i] = l[i] + r[i];
+	}
+}
+
+static void scale_floats(float* out, const float* v, float scale, size_t n)
+{
+	size_t i = 0;
+
+#ifdef VECMATH_SSE
+	__m128 s = _mm_set1_ps(scale);
+	for(; i + 4 <= n; i += 4) {
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(v + i), s));
+	}
+#endif
+	
+	for(; i < n; i++) {
+		out[i] = v[i] * scale;
+	}
+}
+
+void vec2_array_add(Vec2Array* out, const Vec2Array* l, const Vec2Array* r)
+{
+	add_floats(out->x, l->x, r->x, l->count);
+	add_floats(out->y, l->y, r->y, l->count);
+}
+
+void vec2_array_scale(Vec2Array* out, const Vec2Array* v, float scale)
+{
+	scale_floats(out->x, v->x, scale, v->count);
+	scale_floats(out->y, v->y, scale, v->count);
+}
+
+void vec2_array_dot(float* out, const Vec2Array* l, const Vec2Array* r)
+{
+	size_t n = l->count;
+	size_t i = 0;
+
+#ifdef VECMATH_SSE
+	for(; i + 4 <= n; i += 4) {
+		__m128 x = _mm_mul_ps(_mm_loadu_ps(l->x + i), _mm_loadu_ps(r->x + i));
+		__m128 y = _mm_mul_ps(_mm_loadu_ps(l->y + i), _mm_loadu_ps(r->y + i));
+		_mm_storeu_ps(out + i, _mm_add_ps(x, y));
+	}
+#endif
+	
+	for(; i < n; i++) {
+		out[i] = (l->x[i] * r->x[i]) + (l->y[i] * r->y[i]);
+	}
+}
+
+// Zero-length vectors stay zero instead of turning into NaNs.
+void vec2_array_normalize(Vec2Array* out, const Vec2Array* v)
+{
+	size_t n = v->count;
+	size_t i = 0;
+
+#ifdef VECMATH_SSE
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0f);
+	for(; i + 4 <= n; i += 4) {
+		__m128 x = _mm_loadu_ps(v->x + i);
+		__m128 y = _mm_loadu_ps(v->y + i);
+		__m128 len2 = _mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y));
+		__m128 inv = _mm_div_ps(one, _mm_sqrt_ps(len2));
+		inv = _mm_and_ps(inv, _mm_cmpgt_ps(len2, zero));
+		_mm_storeu_ps(out->x + i, _mm_mul_ps(x, inv));
+		_mm_storeu_ps(out->y + i, _mm_mul_ps(y, inv));
+	}
+#endif
+	
+	for(; i < n; i++) {
+		float len2 = (v->x[i] * v->x[i]) + (v->y[i] * v->y[i]);
+		float inv = (len2 > 0) ? 1.0f / sqrtf(len2) : 0.0f;
+		out->x[i] = v->x[i] * inv;
+		out->y[i] = v->y[i] * inv;
+	}
+}
+
+void vec3_array_add(Vec3Array* out, const Vec3Array* l, const Vec3Array* r)
+{
+	add_floats(out->x, l->x, r->x, l->count);
+	add_floats(out->y, l->y, r->y, l->count);
+	add_floats(out->z, l->z, r->z, l->count);
+}
+
+void vec3_array_scale(Vec3Array* out, const Vec3Array* v, float scale)
+{
+	scale_floats(out->x, v->x, scale, v->count);
+	scale_floats(out->y, v->y, scale, v->count);
+	scale_floats(out->z, v->z, scale, v->count);
+}
+
+void vec3_array_dot(float* out, const Vec3Array* l, const Vec3Array* r)
+{
+	size_t n = l->count;
+	size_t i = 0;
+
+#ifdef VECMATH_SSE
+	for(; i + 4 <= n; i += 4) {
+		__m128 x = _mm_mul_ps(_mm_loadu_ps(l->x + i), _mm_loadu_ps(r->x + i));
+		__m128 y = _mm_mul_ps(_mm_loadu_ps(l->y + i), _mm_loadu_ps(r->y + i));
+		__m128 z = _mm_mul_ps(_mm_loadu_ps(l->z + i), _mm_loadu_ps(r->z + i));
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_add_ps(x, y), z));
+	}
+#endif
+	
+	for(; i < n; i++) {
+		out[i] = (l->x[i] * r->x[i]) + (l->y[i] * r->y[i]) + (l->z[i] * r->z[i]);
+	}
+}
+
+void vec3_array_cross(Vec3Array* out, const Vec3Array* l, const Vec3Array* r)
+{
+	size_t n = l->count;
+	size_t i = 0;
+
+#ifdef VECMATH_SSE
+	for(; i + 4 <= n; i += 4) {
+		__m128 lx = _mm_loadu_ps(l->x + i);
+		__m128 ly = _mm_loadu_ps(l->y + i);
+		__m128 lz = _mm_loadu_ps(l->z + i);
+		__m128 rx = _mm_loadu_ps(r->x + i);
+		__m128 ry = _mm_loadu_ps(r->y + i);
+		__m128 rz = _mm_loadu_ps(r->z + i);
+		_mm_storeu_ps(out->x + i, _mm_sub_ps(_mm_mul_ps(ly, rz), _mm_mul_ps(lz, ry)));
+		_mm_storeu_ps(out->y + i, _mm_sub_ps(_mm_mul_ps(lz, rx), _mm_mul_ps(lx, rz)));
+		_mm_storeu_ps(out->z + i, _mm_sub_ps(_mm_mul_ps(lx, ry), _mm_mul_ps(ly, rx)));
+	}
+#endif
+	
+	for(; i < n; i++) {
+		float lx = l->x[i], ly = l->y[i], lz = l->z[i];
+		float rx = r->x[i], ry = r->y[i], rz = r->z[i];
+		out->x[i] = (ly * rz) - (lz * ry);
+		out->y[i] = (lz * rx) - (lx * rz);
+		out->z[i] = (lx * ry) - (ly * rx);
+	}
+}
+
+void vec3_array_normalize(Vec3Array* out, const Vec3Array* v)
+{
+	size_t n = v->count;
+	size_t i = 0;
+
+#ifdef VECMATH_SSE
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0f);
+	for(; i + 4 <= n; i += 4) {
+		__m128 x = _mm_loadu_ps(v->x + i);
+		__m128 y = _mm_loadu_ps(v->y + i);
+		__m128 z = _mm_loadu_ps(v->z + i);
+		__m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+		__m128 inv = _mm_div_ps(one, _mm_sqrt_ps(len2));
+		inv = _mm_and_ps(inv, _mm_cmpgt_ps(len2, zero));
+		_mm_storeu_ps(out->x + i, _mm_mul_ps(x, inv));
+		_mm_storeu_ps(out->y + i, _mm_mul_ps(y, inv));
+		_mm_storeu_ps(out->z + i, _mm_mul_ps(z, inv));
+	}
+#endif
+	
+	for(; i < n; i++) {
+		float len2 = (v->x[i] * v->x[i]) + (v->y[i] * v->y[i]) + (v->z[i] * v->z[i]);
+		float inv = (len2 > 0) ? 1.0f / sqrtf(len2) : 0.0f;
+		out->x[i] = v->x[i] * inv;
+		out->y[i] = v->y[i] * inv;
+		out->z[i] = v->z[i] * inv;
+	}
+}
+
+Mat3 mat3_identity(void)
+{
+	return (Mat3) { {
+		{ 1, 0, 0 },
+		{ 0, 1, 0 },
+		{ 0, 0, 1 }
+	} };
+}
+
+Mat3 mat3_translate(float x, float y)
+{
+	Mat3 out = mat3_identity();
+	out.m[0][2] = x;
+	out.m[1][2] = y;
+	
+	return out;
+}
+
+Mat3 mat3_scale(float x, float y)
+{
+	Mat3 out = mat3_identity();
+	out.m[0][0] = x;
+	out.m[1][1] = y;
+	
+	return out;
+}
+
+Mat3 mat3_rotate(float radians)
+{
+	float c = cosf(radians);
+	float s = sinf(radians);
+	Mat3 out = mat3_identity();
+	out.m[0][0] = c;
+	out.m[0][1] = -s;
+	out.m[1][0] = s;
+	out.m[1][1] = c;
+	
+	return out;
+}
+
+Mat3 mat3_mul(Mat3 l, Mat3 r)
+{
+	Mat3 out;
+	
+	int i, j;
+	for(i = 0; i < 3; i++) {
+		for(j = 0; j < 3; j++) {
+			out.m[i][j] = (l.m[i][0] * r.m[0][j]) + (l.m[i][1] * r.m[1][j]) + (l.m[i][2] * r.m[2][j]);
+		}
+	}
+	
+	return out;
+}
+
+void transform_points(const Mat3* m, Vec2Array* out, const Vec2Array* in)
+{
+	size_t n = in->count;
+	size_t i = 0;
+	float a = m->m[0][0], b = m->m[0][1], tx = m->m[0][2];
+	float c = m->m[1][0], d = m->m[1][1], ty = m->m[1][2];
+
+#ifdef VECMATH_SSE
+	__m128 va = _mm_set1_ps(a), vb = _mm_set1_ps(b), vtx = _mm_set1_ps(tx);
+	__m128 vc = _mm_set1_ps(c), vd = _mm_set1_ps(d), vty = _mm_set1_ps(ty);
+	for(; i + 4 <= n; i += 4) {
+		__m128 x = _mm_loadu_ps(in->x + i);
+		__m128 y = _mm_loadu_ps(in->y + i);
+		_mm_storeu_ps(out->x + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(va, x), _mm_mul_ps(vb, y)), vtx));
+		_mm_storeu_ps(out->y + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(vc, x), _mm_mul_ps(vd, y)), vty));
+	}
+#endif
+	
+	for(; i < n; i++) {
+		float x = in->x[i];
+		float y = in->y[i];
+		out->x[i] = (a * x) + (b * y) + tx;
+		out->y[i] = (c * x) + (d * y) + ty;
+	}
+}
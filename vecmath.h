@@ -0,0 +1,60 @@
+#ifndef VECMATH_H
+#define VECMATH_H
+
+#include "draw.h"
+
+// Structure-of-arrays vectors for batch work: one array per component, each
+// 64-byte aligned, so the kernels below can process four vectors at a time.
+// Output arrays may alias inputs and must hold at least as many elements.
+typedef struct {
+	float* x;
+	float* y;
+	size_t count;
+} Vec2Array;
+
+typedef struct {
+	float* x;
+	float* y;
+	float* z;
+	size_t count;
+} Vec3Array;
+
+// Row-major 3x3 matrix for 2D affine transforms, applied to column vectors
+// (x, y, 1).
+typedef struct {
+	float m[3][3];
+} Mat3;
+
+Vec2Array vec2_array_create(size_t count);
+void vec2_array_destroy(Vec2Array* a);
+Vec3Array vec3_array_create(size_t count);
+void vec3_array_destroy(Vec3Array* a);
+
+void vec2_array_add(Vec2Array* out, const Vec2Array* l, const Vec2Array* r);
+void vec2_array_scale(Vec2Array* out, const Vec2Array* v, float scale);
+void vec2_array_dot(float* out, const Vec2Array* l, const Vec2Array* r);
+void vec2_array_normalize(Vec2Array* out, const Vec2Array* v);
+
+void vec3_array_add(Vec3Array* out, const Vec3Array* l, const Vec3Array* r);
+void vec3_array_scale(Vec3Array* out, const Vec3Array* v, float scale);
+void vec3_array_dot(float* out, const Vec3Array* l, const Vec3Array* r);
+void vec3_array_cross(Vec3Array* out, const Vec3Array* l, const Vec3Array* r);
+void vec3_array_normalize(Vec3Array* out, const Vec3Array* v);
+
+Mat3 mat3_identity(void);
+Mat3 mat3_translate(float x, float y);
+Mat3 mat3_scale(float x, float y);
+Mat3 mat3_rotate(float radians);
+Mat3 mat3_mul(Mat3 l, Mat3 r);
+
+static inline Point2D mat3_transform_point(Mat3 m, Point2D p)
+{
+	return (Point2D) {
+		(m.m[0][0] * p.x) + (m.m[0][1] * p.y) + m.m[0][2],
+		(m.m[1][0] * p.x) + (m.m[1][1] * p.y) + m.m[1][2]
+	};
+}
+
+void transform_points(const Mat3* m, Vec2Array* out, const Vec2Array* in);
+
+#endif //VECMATH_H